@@ -0,0 +1,56 @@
+#   Copyright 2024 Scott Bezek and the splitflap contributors
+#
+#   Licensed under the Apache License, Version 2.0 (the "License");
+#   you may not use this file except in compliance with the License.
+#   You may obtain a copy of the License at
+#
+#       http://www.apache.org/licenses/LICENSE-2.0
+#
+#   Unless required by applicable law or agreed to in writing, software
+#   distributed under the License is distributed on an "AS IS" BASIS,
+#   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#   See the License for the specific language governing permissions and
+#   limitations under the License.
+
+# Generates the host-side table of structured log formats (firmware/esp32/core/log_formats.h) so hosts can turn
+# LogRecords back into text. Runs as a PlatformIO pre-build script, or standalone.
+
+import json
+import os
+import re
+
+FORMAT_ENTRY = re.compile(r'X\(\s*(\d+)\s*,\s*(\w+)\s*,\s*("(?:[^"\\]|\\.)*")\s*\)')
+
+
+def generate(repo_root):
+    header_path = os.path.join(repo_root, 'firmware', 'esp32', 'core', 'log_formats.h')
+    output_path = os.path.join(repo_root, 'software', 'chainlink', 'proto_gen', 'log_formats.json')
+
+    with open(header_path) as f:
+        header = f.read()
+
+    formats = {}
+    for format_id, name, literal in FORMAT_ENTRY.findall(header):
+        assert format_id not in formats, f'Duplicate log format ID {format_id} ({name})'
+        # C string literals in the table are plain ASCII, so JSON string escaping is close enough to decode them
+        formats[format_id] = {'name': name, 'format': json.loads(literal)}
+    assert len(formats) > 0, f'No log formats found in {header_path}'
+
+    contents = json.dumps(formats, indent=2, ensure_ascii=False) + '\n'
+    try:
+        with open(output_path) as f:
+            if f.read() == contents:
+                return
+    except FileNotFoundError:
+        pass
+    with open(output_path, 'w') as f:
+        f.write(contents)
+    print(f'Updated {output_path}')
+
+
+try:
+    Import("env")
+    generate(env['PROJECT_DIR'])
+except NameError:
+    if __name__ == '__main__':
+        generate(os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
@@ -353,7 +353,8 @@ void BaseSupervisorTask::readPower() {
 }
 
 void BaseSupervisorTask::updateSplitflapState() {
-    splitflap_state_ = splitflap_task_.getState();
+    // Power is polled every iteration regardless, so just skip the copy when the state hasn't changed
+    splitflap_task_.getStateIfChanged(splitflap_state_generation_, splitflap_state_);
 }
 
 void BaseSupervisorTask::fault(PB_SupervisorState_FaultInfo_FaultType type, const char* msg) {
@@ -0,0 +1,125 @@
+/*
+   Copyright 2024 Scott Bezek and the splitflap contributors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#pragma once
+
+#include <atomic>
+
+#include <Arduino.h>
+
+/**
+ * Bounded lock-free single-producer/single-consumer ring of fixed-size slots.
+ *
+ * Slots are filled and consumed in place, so large values are never copied through an intermediate buffer. Each
+ * slot tracks its own state, which lets the producer take back its newest slot (e.g. to merge a newer value into
+ * it) as long as the consumer hasn't started on it yet.
+ *
+ * Exactly one task may call the producer methods and exactly one task may call the consumer methods.
+ */
+template <typename T, uint8_t N>
+class CommandRing {
+    static_assert(N >= 2, "CommandRing needs at least 2 slots");
+
+    public:
+        CommandRing() {}
+        CommandRing(CommandRing const&)=delete;
+        CommandRing& operator=(CommandRing const&)=delete;
+
+        // ---- Producer ----
+
+        /** Returns the next free slot for writing, or nullptr if the ring is full. Must be followed by publish(). */
+        T* reserve() {
+            Slot& slot = slots_[head_];
+            if (slot.state.load(std::memory_order_acquire) != FREE) {
+                return nullptr;
+            }
+            slot.state.store(WRITING, std::memory_order_relaxed);
+            reclaimed_ = false;
+            return &slot.value;
+        }
+
+        /**
+         * Takes back the most recently published slot if the consumer hasn't picked it up yet, or returns nullptr.
+         * Must be followed by publish() (even if the slot is left unmodified).
+         */
+        T* reclaimNewest() {
+            Slot& slot = slots_[prev(head_)];
+            uint32_t expected = READY;
+            if (!slot.state.compare_exchange_strong(expected, WRITING, std::memory_order_acquire)) {
+                return nullptr;
+            }
+            reclaimed_ = true;
+            return &slot.value;
+        }
+
+        /** Hands the slot returned by reserve() or reclaimNewest() (back) to the consumer. */
+        void publish() {
+            if (reclaimed_) {
+                slots_[prev(head_)].state.store(READY, std::memory_order_release);
+                reclaimed_ = false;
+            } else {
+                slots_[head_].state.store(READY, std::memory_order_release);
+                head_ = next(head_);
+            }
+        }
+
+        // ---- Consumer ----
+
+        /** Returns the oldest published slot for reading, or nullptr if there is none. Must be followed by pop(). */
+        T* peek() {
+            Slot& slot = slots_[tail_];
+            uint32_t expected = READY;
+            if (!slot.state.compare_exchange_strong(expected, READING, std::memory_order_acquire)) {
+                return nullptr;
+            }
+            return &slot.value;
+        }
+
+        /** Releases the slot returned by peek() back to the producer. */
+        void pop() {
+            slots_[tail_].state.store(FREE, std::memory_order_release);
+            tail_ = next(tail_);
+        }
+
+    private:
+        enum : uint32_t {
+            FREE,
+            WRITING,
+            READY,
+            READING,
+        };
+
+        struct Slot {
+            std::atomic<uint32_t> state {FREE};
+            T value;
+        };
+
+        static uint8_t next(uint8_t i) {
+            return i + 1 == N ? 0 : i + 1;
+        }
+
+        static uint8_t prev(uint8_t i) {
+            return i == 0 ? N - 1 : i - 1;
+        }
+
+        Slot slots_[N];
+
+        // Owned by the producer
+        uint8_t head_ = 0;
+        bool reclaimed_ = false;
+
+        // Owned by the consumer
+        uint8_t tail_ = 0;
+};
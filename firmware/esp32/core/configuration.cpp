@@ -22,11 +22,25 @@
 
 #include "config.h"
 #include "configuration.h"
+#include "crc32.h"
 #include "semaphore_guard.h"
 
-static const char* CONFIG_PATH = "/config.pb";
+static const char* CONFIG_JOURNAL_PATH = "/config.log";
+static const char* CONFIG_JOURNAL_TEMP_PATH = "/config.log.tmp";
 
-Configuration::Configuration() {
+// Written by firmware before the journal; read once and replaced by the journal on the next save
+static const char* LEGACY_CONFIG_PATH = "/config.pb";
+
+static const uint8_t CONFIG_RECORD_MAGIC = 0xA5;
+static const size_t MODULE_OFFSET_ENTRY_BYTES = 3;
+
+static_assert(sizeof(ConfigRecordHeader) == 8, "ConfigRecordHeader must not be padded");
+static_assert(
+    MODULE_OFFSET_ENTRY_BYTES * (sizeof(PB_PersistentConfiguration::module_offset_steps) / sizeof(uint16_t))
+        <= PB_PersistentConfiguration_size,
+    "Module offset record must fit in the record buffers");
+
+Configuration::Configuration(const uint8_t task_core) : Task("Config", 4096, 1, task_core) {
   mutex_ = xSemaphoreCreateMutex();
   assert(mutex_ != NULL);
 }
@@ -35,27 +49,66 @@ Configuration::~Configuration() {
   vSemaphoreDelete(mutex_);
 }
 
-bool Configuration::loadFromDisk() {
-    SemaphoreGuard lock(mutex_);
-    FatGuard fatGuard(logger_);
-    if (!fatGuard.mounted_) {
+// Mounts FFat the first time it's needed; it then stays mounted. Must be called with mutex_ held.
+bool Configuration::mount() {
+    if (mounted_) {
+        return true;
+    }
+    if (!FFat.begin(true)) {
+        log("Failed to mount FFat");
         return false;
     }
+    log("Mounted FFat");
+    mounted_ = true;
+    return true;
+}
 
-    File f = FFat.open(CONFIG_PATH);
-    if (!f) {
-        log("Failed to read config file");
-        return false;
+void Configuration::run() {
+    while (1) {
+        SaveStatus status = getSaveStatus();
+        if (status.requested == status.completed) {
+            // Woken by save requests
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+
+        bool success = saveToDisk();
+
+        // The latest values were written, so this covers every request made before the save started
+        SemaphoreGuard lock(mutex_);
+        save_status_.completed = status.requested;
+        save_status_.success = success;
+    }
+}
+
+uint32_t Configuration::requestSave() {
+    uint32_t save_id;
+    {
+        SemaphoreGuard lock(mutex_);
+        save_id = ++save_status_.requested;
     }
+    // Picked up when the task starts if it hasn't yet
+    if (getHandle() != nullptr) {
+        xTaskNotifyGive(getHandle());
+    }
+    return save_id;
+}
 
-    size_t read = f.readBytes((char*)buffer_, sizeof(buffer_));
-    f.close();
+SaveStatus Configuration::getSaveStatus() {
+    SemaphoreGuard lock(mutex_);
+    return save_status_;
+}
 
-    pb_istream_t stream = pb_istream_from_buffer(buffer_, read);
-    if (!pb_decode(&stream, PB_PersistentConfiguration_fields, &pb_buffer_)) {
-        char buf[200];
-        snprintf(buf, sizeof(buf), "Decoding failed: %s", PB_GET_ERROR(&stream));
-        log(buf);
+bool Configuration::loadFromDisk() {
+    SemaphoreGuard lock(mutex_);
+    if (!mount()) {
+        return false;
+    }
+
+    // The temporary journal is only used on its own if a compaction was interrupted after removing the old journal;
+    // the legacy single-file config is migrated to the journal by the next save.
+    if (!replayJournal(CONFIG_JOURNAL_PATH) && !replayJournal(CONFIG_JOURNAL_TEMP_PATH) && !loadLegacyConfig()) {
+        log("Failed to read config file");
         pb_buffer_ = {};
         return false;
     }
@@ -65,6 +118,7 @@ bool Configuration::loadFromDisk() {
         snprintf(buf, sizeof(buf), "Invalid config version. Expected %u, received %u", PERSISTENT_CONFIGURATION_VERSION, pb_buffer_.version);
         log(buf);
         pb_buffer_ = {};
+        journal_needs_compaction_ = true;
         return false;
     }
 
@@ -73,9 +127,11 @@ bool Configuration::loadFromDisk() {
         snprintf(buf, sizeof(buf), "Invalid config - stored num_flaps was %u but this firmware expects %u. Ignoring saved config.", pb_buffer_.num_flaps, NUM_FLAPS);
         log(buf);
         pb_buffer_ = {};
+        journal_needs_compaction_ = true;
         return false;
     }
     loaded_ = true;
+    persisted_ = pb_buffer_;
 
     char buf[200];
     snprintf(
@@ -108,42 +164,261 @@ bool Configuration::loadFromDisk() {
     return true;
 }
 
-bool Configuration::saveToDisk() {
-    SemaphoreGuard lock(mutex_);
+// Replays the journal at path into pb_buffer_. Records are applied in order up to the first one that is incomplete or
+// fails its CRC (e.g. a save interrupted by a reset); that tail is dropped by the next compaction. Must be called with
+// mutex_ held.
+bool Configuration::replayJournal(const char* path) {
+    File f = FFat.open(path);
+    if (!f) {
+        return false;
+    }
+
+    bool have_snapshot = false;
+    uint32_t records = 0;
+    size_t valid_bytes = 0;
+    ConfigRecordHeader header;
+    while (f.read((uint8_t*)&header, sizeof(header)) == sizeof(header)) {
+        if (header.magic != CONFIG_RECORD_MAGIC || header.length > sizeof(buffer_)) {
+            break;
+        }
+        if (f.read(buffer_, header.length) != header.length) {
+            break;
+        }
+
+        uint32_t crc = 0;
+        crc32(&header, offsetof(ConfigRecordHeader, crc), &crc);
+        crc32(buffer_, header.length, &crc);
+        if (crc != header.crc || !applyRecord(header, have_snapshot)) {
+            break;
+        }
+        records++;
+        valid_bytes += sizeof(header) + header.length;
+    }
+    size_t file_bytes = f.size();
+    f.close();
+
+    char buf[200];
+    if (!have_snapshot) {
+        snprintf(buf, sizeof(buf), "No valid config snapshot in %s", path);
+        log(buf);
+        pb_buffer_ = {};
+        return false;
+    }
+
+    journal_bytes_ = valid_bytes;
+    journal_needs_compaction_ = valid_bytes != file_bytes || strcmp(path, CONFIG_JOURNAL_PATH) != 0;
+
+    snprintf(buf, sizeof(buf), "Replayed %u config records (%u bytes) from %s", records, valid_bytes, path);
+    log(buf);
+    if (valid_bytes != file_bytes) {
+        snprintf(buf, sizeof(buf), "Ignoring %u bytes of incomplete or corrupt config records", file_bytes - valid_bytes);
+        log(buf);
+    }
+    return true;
+}
+
+// Applies one verified record from buffer_ to pb_buffer_. Unknown record types are skipped so older firmware can still
+// read journals written by newer firmware.
+bool Configuration::applyRecord(const ConfigRecordHeader& header, bool& have_snapshot) {
+    switch (static_cast<ConfigRecordType>(header.type)) {
+        case ConfigRecordType::SNAPSHOT: {
+            pb_istream_t stream = pb_istream_from_buffer(buffer_, header.length);
+            if (!pb_decode(&stream, PB_PersistentConfiguration_fields, &pb_buffer_)) {
+                char buf[200];
+                snprintf(buf, sizeof(buf), "Decoding failed: %s", PB_GET_ERROR(&stream));
+                log(buf);
+                return false;
+            }
+            have_snapshot = true;
+            return true;
+        }
+        case ConfigRecordType::MODULE_OFFSETS: {
+            if (!have_snapshot || header.length % MODULE_OFFSET_ENTRY_BYTES != 0) {
+                return false;
+            }
+            for (size_t i = 0; i < header.length; i += MODULE_OFFSET_ENTRY_BYTES) {
+                uint8_t module = buffer_[i];
+                if (module >= pb_buffer_.module_offset_steps_count) {
+                    return false;
+                }
+                pb_buffer_.module_offset_steps[module] = buffer_[i + 1] | (buffer_[i + 2] << 8);
+            }
+            return true;
+        }
+        default:
+            return true;
+    }
+}
+
+// Reads the single-file configuration written by older firmware. Must be called with mutex_ held.
+bool Configuration::loadLegacyConfig() {
+    File f = FFat.open(LEGACY_CONFIG_PATH);
+    if (!f) {
+        return false;
+    }
+
+    size_t read = f.readBytes((char*)buffer_, sizeof(buffer_));
+    f.close();
 
-    pb_ostream_t stream = pb_ostream_from_buffer(buffer_, sizeof(buffer_));
-    pb_buffer_.version = PERSISTENT_CONFIGURATION_VERSION;
-    if (!pb_encode(&stream, PB_PersistentConfiguration_fields, &pb_buffer_)) {
+    pb_istream_t stream = pb_istream_from_buffer(buffer_, read);
+    if (!pb_decode(&stream, PB_PersistentConfiguration_fields, &pb_buffer_)) {
         char buf[200];
-        snprintf(buf, sizeof(buf), "Encoding failed: %s", PB_GET_ERROR(&stream));
+        snprintf(buf, sizeof(buf), "Decoding failed: %s", PB_GET_ERROR(&stream));
         log(buf);
+        pb_buffer_ = {};
+        return false;
+    }
+
+    log("Loaded legacy config file; it will be migrated on the next save");
+    journal_bytes_ = 0;
+    journal_needs_compaction_ = true;
+    return true;
+}
+
+// Writes the latest configuration. Only called by the task; the (slow) write itself is done without holding mutex_, so
+// other tasks can keep reading and updating the configuration meanwhile. Changes to module offsets alone are appended
+// to the journal; anything else, or a journal that is damaged or too large, is written as a new snapshot.
+bool Configuration::saveToDisk() {
+    {
+        SemaphoreGuard lock(mutex_);
+        pb_buffer_.version = PERSISTENT_CONFIGURATION_VERSION;
+        pending_ = pb_buffer_;
+        if (!mount()) {
+            return false;
+        }
+    }
+
+    size_t length;
+    if (!journal_needs_compaction_ && encodeOffsetChanges(length)) {
+        if (length == 0) {
+            // Nothing changed since the last save
+            return true;
+        }
+        if (journal_bytes_ + sizeof(ConfigRecordHeader) + length <= CONFIG_JOURNAL_COMPACT_BYTES) {
+            if (appendRecord(ConfigRecordType::MODULE_OFFSETS, length)) {
+                persisted_ = pending_;
+                return true;
+            }
+            // A partial append leaves a torn record at the end, which the snapshot below replaces
+            journal_needs_compaction_ = true;
+        }
+    }
+
+    return compactJournal();
+}
+
+// Encodes the module offsets that differ between pending_ and persisted_ as a MODULE_OFFSETS payload in write_buffer_.
+// Returns false if anything else changed, which needs a full snapshot.
+bool Configuration::encodeOffsetChanges(size_t& length) {
+    if (pending_.version != persisted_.version
+            || pending_.num_flaps != persisted_.num_flaps
+            || pending_.module_offset_steps_count != persisted_.module_offset_steps_count) {
+        return false;
+    }
+
+    uint8_t* payload = write_buffer_ + sizeof(ConfigRecordHeader);
+    length = 0;
+    for (pb_size_t i = 0; i < pending_.module_offset_steps_count; i++) {
+        uint16_t offset = pending_.module_offset_steps[i];
+        if (offset == persisted_.module_offset_steps[i]) {
+            continue;
+        }
+        payload[length++] = i;
+        payload[length++] = offset & 0xFF;
+        payload[length++] = offset >> 8;
+    }
+    return true;
+}
+
+// Appends the record whose payload is already in write_buffer_, in a single write.
+bool Configuration::appendRecord(ConfigRecordType type, size_t length) {
+    size_t total = fillRecordHeader(type, length);
+
+    File f = FFat.open(CONFIG_JOURNAL_PATH, FILE_APPEND);
+    if (!f) {
+        log("Failed to open config journal");
+        return false;
+    }
+    size_t written = f.write(write_buffer_, total);
+    f.close();
+
+    if (written != total) {
+        log("Failed to write all bytes to config journal");
         return false;
     }
+    journal_bytes_ += total;
+
+    char buf[50];
+    snprintf(buf, sizeof(buf), "Appended %u byte config record", total);
+    log(buf);
+    return true;
+}
 
-    FatGuard fatGuard(logger_);
-    if (!fatGuard.mounted_) {
+// Rewrites the journal as a single snapshot of pending_. The snapshot goes to a temporary file that replaces the
+// journal only once fully written, so a reset at any point leaves either the old or the new journal readable.
+bool Configuration::compactJournal() {
+    pb_ostream_t stream = pb_ostream_from_buffer(write_buffer_ + sizeof(ConfigRecordHeader), PB_PersistentConfiguration_size);
+    if (!pb_encode(&stream, PB_PersistentConfiguration_fields, &pending_)) {
+        char buf[200];
+        snprintf(buf, sizeof(buf), "Encoding failed: %s", PB_GET_ERROR(&stream));
+        log(buf);
         return false;
     }
-    File f = FFat.open(CONFIG_PATH, FILE_WRITE);
+    size_t total = fillRecordHeader(ConfigRecordType::SNAPSHOT, stream.bytes_written);
+
+    File f = FFat.open(CONFIG_JOURNAL_TEMP_PATH, FILE_WRITE);
     if (!f) {
         log("Failed to open config file");
         return false;
     }
-    size_t written = f.write(buffer_, stream.bytes_written);
+    size_t written = f.write(write_buffer_, total);
     f.close();
 
-    char buf[20];
-    snprintf(buf, sizeof(buf), "Wrote %d bytes", written);
+    char buf[50];
+    snprintf(buf, sizeof(buf), "Wrote %u byte config snapshot", written);
     log(buf);
 
-    if (written != stream.bytes_written) {
+    if (written != total) {
         log("Failed to write all bytes to file");
         return false;
     }
 
+    if (FFat.exists(CONFIG_JOURNAL_PATH) && !FFat.remove(CONFIG_JOURNAL_PATH)) {
+        log("Failed to remove old config journal");
+        return false;
+    }
+    // The snapshot is saved either way: it is read from the temporary file while the journal is missing
+    persisted_ = pending_;
+    if (!FFat.rename(CONFIG_JOURNAL_TEMP_PATH, CONFIG_JOURNAL_PATH)) {
+        log("Failed to rename config journal");
+        journal_needs_compaction_ = true;
+        return true;
+    }
+    journal_bytes_ = total;
+    journal_needs_compaction_ = false;
+
+    if (FFat.exists(LEGACY_CONFIG_PATH)) {
+        FFat.remove(LEGACY_CONFIG_PATH);
+    }
     return true;
 }
 
+// Fills in the header in front of the length-byte payload in write_buffer_. Returns the size of the whole record.
+size_t Configuration::fillRecordHeader(ConfigRecordType type, size_t length) {
+    ConfigRecordHeader header = {};
+    header.magic = CONFIG_RECORD_MAGIC;
+    header.type = static_cast<uint8_t>(type);
+    header.length = length;
+
+    uint32_t crc = 0;
+    crc32(&header, offsetof(ConfigRecordHeader, crc), &crc);
+    crc32(write_buffer_ + sizeof(header), length, &crc);
+    header.crc = crc;
+
+    memcpy(write_buffer_, &header, sizeof(header));
+    return sizeof(header) + length;
+}
+
 PB_PersistentConfiguration Configuration::get() {
     SemaphoreGuard lock(mutex_);
     if (!loaded_) {
@@ -152,7 +427,7 @@ PB_PersistentConfiguration Configuration::get() {
     return pb_buffer_;
 }
 
-bool Configuration::setModuleOffsetsAndSave(uint16_t offsets[NUM_MODULES]) {
+uint32_t Configuration::setModuleOffsetsAndSave(uint16_t offsets[NUM_MODULES]) {
     {
         SemaphoreGuard lock(mutex_);
         pb_buffer_.num_flaps = NUM_FLAPS;
@@ -161,7 +436,7 @@ bool Configuration::setModuleOffsetsAndSave(uint16_t offsets[NUM_MODULES]) {
             pb_buffer_.module_offset_steps[i] = offsets[i];
         }
     }
-    return saveToDisk();
+    return requestSave();
 }
 
 void Configuration::setLogger(Logger* logger) {
@@ -21,58 +21,104 @@
 #include "../proto_gen/splitflap.pb.h"
 
 #include "logger.h"
+#include "task.h"
 
 const uint32_t PERSISTENT_CONFIGURATION_VERSION = 1;
 
-class Configuration {
+// Journal size at which the next save rewrites it as a single snapshot
+const size_t CONFIG_JOURNAL_COMPACT_BYTES = 16 * 1024;
+
+enum class ConfigRecordType : uint8_t {
+    // Encoded PB_PersistentConfiguration, replacing everything before it
+    SNAPSHOT = 1,
+
+    // Changed module offsets: (uint8 module index, uint16 little-endian offset) per module
+    MODULE_OFFSETS = 2,
+};
+
+struct ConfigRecordHeader {
+    uint8_t magic;
+    uint8_t type;
+    uint16_t length;
+
+    // CRC32 of the four bytes above followed by the payload
+    uint32_t crc;
+};
+
+struct SaveStatus {
+    // ID of the most recent save request (0 if none yet)
+    uint32_t requested;
+
+    // ID of the most recent save that finished; every request up to it has been written (or failed)
+    uint32_t completed;
+
+    // Whether that save succeeded
+    bool success;
+};
+
+/**
+ * Persistent configuration. Saves are done by this class's own task, which keeps the filesystem mounted, so callers
+ * (e.g. the splitflap planner) never wait on flash. Requests made while a save is in progress are coalesced into a
+ * single write of the latest values.
+ *
+ * The configuration is stored as an append-only journal of CRC-checked records: a full snapshot followed by small
+ * records that only hold what changed (e.g. a few module offsets after calibration). Once the journal grows past
+ * CONFIG_JOURNAL_COMPACT_BYTES it is compacted into a single snapshot, written to a temporary file and renamed into
+ * place, so an interrupted save never loses the previous configuration.
+ */
+class Configuration : public Task<Configuration> {
+    friend class Task<Configuration>; // Allow base Task to invoke protected run()
+
     public:
-        Configuration();
+        Configuration(const uint8_t task_core = 0);
         ~Configuration();
 
         void setLogger(Logger* logger);
+
+        /** Synchronously reads the saved configuration; may be called before the task is started. */
         bool loadFromDisk();
-        bool saveToDisk();
+
         PB_PersistentConfiguration get();
-        bool setModuleOffsetsAndSave(uint16_t offsets[NUM_MODULES]);
+
+        /** Updates the module offsets and queues a save without waiting for it. Returns the save's ID. */
+        uint32_t setModuleOffsetsAndSave(uint16_t offsets[NUM_MODULES]);
+
+        /** Queues a save of the current configuration without waiting for it. Returns the save's ID. */
+        uint32_t requestSave();
+
+        SaveStatus getSaveStatus();
+
+    protected:
+        void run();
 
     private:
         SemaphoreHandle_t mutex_;
 
         Logger* logger_ = nullptr;
         bool loaded_ = false;
+        bool mounted_ = false;
         PB_PersistentConfiguration pb_buffer_ = {};
 
         uint8_t buffer_[PB_PersistentConfiguration_size];
 
-        void log(const char* msg);
-};
-class FatGuard {
-    public:
-        FatGuard(Logger* logger) : logger_(logger) {
-            if (!FFat.begin(true)) {
-                if (logger_ != nullptr) {
-                    logger_->log("Failed to mount FFat");
-                }
-                return;
-            }
-            if (logger_ != nullptr) {
-                logger_->log("Mounted FFat");
-            }
-            mounted_ = true;
-        }
-        ~FatGuard() {
-            if (mounted_) {
-                FFat.end();
-                if (logger_ != nullptr) {
-                    logger_->log("Unmounted FFat");
-                }
-            }
-        }
-        FatGuard(FatGuard const&)=delete;
-        FatGuard& operator=(FatGuard const&)=delete;
+        // Protected by mutex_
+        SaveStatus save_status_ = {};
 
-        bool mounted_ = false;
+        // Owned by the task (or by loadFromDisk() before the task is started)
+        uint8_t write_buffer_[sizeof(ConfigRecordHeader) + PB_PersistentConfiguration_size];
+        PB_PersistentConfiguration pending_ = {};
+        PB_PersistentConfiguration persisted_ = {};
+        size_t journal_bytes_ = 0;
+        bool journal_needs_compaction_ = true;
 
-    private:
-        Logger* logger_;
+        bool mount();
+        bool replayJournal(const char* path);
+        bool applyRecord(const ConfigRecordHeader& header, bool& have_snapshot);
+        bool loadLegacyConfig();
+        bool saveToDisk();
+        bool encodeOffsetChanges(size_t& length);
+        bool appendRecord(ConfigRecordType type, size_t length);
+        bool compactJournal();
+        size_t fillRecordHeader(ConfigRecordType type, size_t length);
+        void log(const char* msg);
 };
@@ -0,0 +1,69 @@
+/* Standard (zlib-compatible) CRC32 checksum.
+ *
+ * On ESP32 this uses the table-driven crc32_le in ROM, which needs no RAM or flash for tables. Elsewhere it falls back
+ * to slice-by-8, with tables computed at compile time so there's no lazy initialization to race on. */
+
+#include "crc32.h"
+
+#if defined(ESP32)
+
+#include <rom/crc.h>
+
+void crc32(const void *data, size_t n_bytes, uint32_t* crc) {
+  // crc32_le does the pre/post inversion itself, so it chains the same way zlib's crc32() does
+  *crc = crc32_le(*crc, (const uint8_t*)data, n_bytes);
+}
+
+#else
+
+namespace {
+
+constexpr uint32_t crc32Bits(uint32_t r, int bits) {
+  return bits == 0 ? r : crc32Bits((r & 1) ? (r >> 1) ^ (uint32_t)0xEDB88320L : r >> 1, bits - 1);
+}
+
+// Entry i of slice k is the CRC contribution of byte i followed by k zero bytes
+constexpr uint32_t crc32Slice(uint32_t i, int slice) {
+  return slice == 0 ? crc32Bits(i, 8) : (crc32Slice(i, slice - 1) >> 8) ^ crc32Bits(crc32Slice(i, slice - 1) & 0xFF, 8);
+}
+
+template <uint32_t... I> struct IndexList {};
+template <uint32_t N, uint32_t... I> struct MakeIndexList : MakeIndexList<N - 1, N - 1, I...> {};
+template <uint32_t... I> struct MakeIndexList<0, I...> { typedef IndexList<I...> type; };
+
+template <typename T> struct Crc32Tables;
+template <uint32_t... I> struct Crc32Tables<IndexList<I...>> {
+  static constexpr uint32_t table[8][256] = {
+    {crc32Slice(I, 0)...}, {crc32Slice(I, 1)...}, {crc32Slice(I, 2)...}, {crc32Slice(I, 3)...},
+    {crc32Slice(I, 4)...}, {crc32Slice(I, 5)...}, {crc32Slice(I, 6)...}, {crc32Slice(I, 7)...},
+  };
+};
+template <uint32_t... I> constexpr uint32_t Crc32Tables<IndexList<I...>>::table[8][256];
+
+typedef Crc32Tables<MakeIndexList<256>::type> Tables;
+
+inline uint32_t load32le(const uint8_t* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+}
+
+void crc32(const void *data, size_t n_bytes, uint32_t* crc) {
+  const uint32_t (&t)[8][256] = Tables::table;
+  const uint8_t* p = (const uint8_t*)data;
+  uint32_t c = ~*crc;
+  while (n_bytes >= 8) {
+    uint32_t one = load32le(p) ^ c;
+    uint32_t two = load32le(p + 4);
+    c = t[7][one & 0xFF] ^ t[6][(one >> 8) & 0xFF] ^ t[5][(one >> 16) & 0xFF] ^ t[4][one >> 24]
+      ^ t[3][two & 0xFF] ^ t[2][(two >> 8) & 0xFF] ^ t[1][(two >> 16) & 0xFF] ^ t[0][two >> 24];
+    p += 8;
+    n_bytes -= 8;
+  }
+  while (n_bytes--) {
+    c = t[0][(c ^ *p++) & 0xFF] ^ (c >> 8);
+  }
+  *crc = ~c;
+}
+
+#endif
@@ -0,0 +1,12 @@
+/* Standard (zlib-compatible) CRC32 checksum. */
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * Updates a running CRC32 with n_bytes of data. Start with *crc = 0; calls can be chained to checksum data in pieces,
+ * and the result matches zlib's crc32(). Safe to call from any task.
+ */
+void crc32(const void *data, size_t n_bytes, uint32_t* crc);
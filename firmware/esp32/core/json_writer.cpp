@@ -0,0 +1,74 @@
+/*
+   Copyright 2024 Scott Bezek and the splitflap contributors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "json_writer.h"
+
+void JsonWriter::raw(const char* text) {
+    size_t length = strlen(text);
+    if (length > capacity_ - length_) {
+        length = capacity_ - length_;
+        overflowed_ = true;
+    }
+    memcpy(buffer_ + length_, text, length);
+    length_ += length;
+}
+
+void JsonWriter::raw(char c) {
+    if (length_ == capacity_) {
+        overflowed_ = true;
+        return;
+    }
+    buffer_[length_++] = c;
+}
+
+void JsonWriter::string(const char* text, size_t length) {
+    static const char HEX_DIGITS[] = "0123456789abcdef";
+
+    raw('"');
+    for (size_t i = 0; i < length; i++) {
+        char c = text[i];
+        switch (c) {
+            case '"':  raw("\\\""); break;
+            case '\\': raw("\\\\"); break;
+            case '\b': raw("\\b"); break;
+            case '\f': raw("\\f"); break;
+            case '\n': raw("\\n"); break;
+            case '\r': raw("\\r"); break;
+            case '\t': raw("\\t"); break;
+            default:
+                if ((uint8_t) c < 0x20) {
+                    raw("\\u00");
+                    raw(HEX_DIGITS[(c >> 4) & 0xF]);
+                    raw(HEX_DIGITS[c & 0xF]);
+                } else {
+                    raw(c);
+                }
+                break;
+        }
+    }
+    raw('"');
+}
+
+void JsonWriter::number(uint32_t value) {
+    char digits[10];
+    uint8_t count = 0;
+    do {
+        digits[count++] = '0' + value % 10;
+        value /= 10;
+    } while (value != 0);
+    while (count > 0) {
+        raw(digits[--count]);
+    }
+}
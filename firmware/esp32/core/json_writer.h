@@ -0,0 +1,62 @@
+/*
+   Copyright 2024 Scott Bezek and the splitflap contributors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * Appends JSON to a fixed, caller-provided buffer, so a whole message can be built without allocating and then
+ * written out at once. Anything that doesn't fit is cut off and flagged via overflowed().
+ */
+class JsonWriter {
+    public:
+        JsonWriter(char* buffer, size_t capacity) : buffer_(buffer), capacity_(capacity) {}
+
+        /** Appends text as-is (punctuation, keys, and anything else known not to need escaping) */
+        void raw(const char* text);
+        void raw(char c);
+
+        /** Appends a quoted and escaped JSON string */
+        void string(const char* text, size_t length);
+        void string(const char* text) {
+            string(text, strlen(text));
+        }
+
+        void number(uint32_t value);
+
+        const char* data() const {
+            return buffer_;
+        }
+
+        size_t length() const {
+            return length_;
+        }
+
+        bool overflowed() const {
+            return overflowed_;
+        }
+
+    private:
+        char* const buffer_;
+        const size_t capacity_;
+        size_t length_ = 0;
+        bool overflowed_ = false;
+};
+
+// Worst case length of a string of n bytes once escaped and quoted by JsonWriter::string()
+#define JSON_STRING_MAX_LENGTH(n) (2 + 6 * (n))
@@ -0,0 +1,65 @@
+/*
+   Copyright 2024 Scott Bezek and the splitflap contributors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Structured log messages.
+ *
+ * Call sites log one of these IDs plus up to MAX_LOG_ARGS integer/float arguments instead of a formatted string, so
+ * nothing is formatted or allocated on the logging task, and the proto protocol sends only the ID and raw arguments.
+ * Hosts turn records back into text using software/chainlink/proto_gen/log_formats.json, which
+ * firmware/buildscript_log_formats.py regenerates from this list on every build.
+ *
+ * IDs are part of the serial protocol: never reuse or renumber one, only add new entries (or retire old ones).
+ * Supported conversions are %d/%i, %u, %x/%X, %c and %f (with optional flags, width and precision).
+ */
+#define LOG_FORMATS(X) \
+    X(1,  CHAIN_NOT_DETECTED,        "Unable to detect any Chainlink Drivers, assuming NUM_MODULES") \
+    X(2,  CHAIN_DETECTED,            "Detected %u modules (max %u)") \
+    X(3,  LOOPBACK_INCORRECT,        "Loopback ERROR. Set output %u but read incorrect value at input %u") \
+    X(4,  LOOPBACK_SET_WHEN_OFF,     "Loopback ERROR. Loopback %u was set when all outputs off - should have been 0") \
+    X(5,  LOOPBACK_ERROR,            "Loopback ERROR!") \
+    X(6,  LOOPBACK_OK,               "Loopback is ok!") \
+    X(7,  DISABLED_ALL,              "Disabled all modules") \
+    X(8,  SAVE_OFFSETS_IN_PROGRESS,  "Can't save offsets; previous save still in progress") \
+    X(9,  SAVE_OFFSETS_NOT_IDLE,     "Can't save offsets; module %u isn't idle") \
+    X(10, UNKNOWN_PLAN,              "Unknown plan") \
+    X(11, UNKNOWN_MODULE_ACTION,     "Unknown module action") \
+    X(12, INVALID_FLAP_INDEX,        "Invalid flap index (%u) specified for module %u") \
+    X(13, UNKNOWN_COMMAND,           "Unknown command") \
+    X(14, SAVING_CALIBRATION,        "Saving calibration...") \
+    X(15, SAVED_CALIBRATION,         "SUCCESS - saved calibration!") \
+    X(16, SAVE_CALIBRATION_FAILED,   "ERROR - failed to save calibration") \
+    X(17, DROPPED_SHOW_STRING,       "Dropped showString command")
+
+enum LogFormatId : uint16_t {
+    #define LOG_FORMAT_ENUM(id, name, format) LOG_##name = id,
+    LOG_FORMATS(LOG_FORMAT_ENUM)
+    #undef LOG_FORMAT_ENUM
+};
+
+// Returns the format string for format_id, or nullptr if it's unknown
+inline const char* getLogFormat(uint16_t format_id) {
+    switch (format_id) {
+        #define LOG_FORMAT_CASE(id, name, format) case id: return format;
+        LOG_FORMATS(LOG_FORMAT_CASE)
+        #undef LOG_FORMAT_CASE
+        default:
+            return nullptr;
+    }
+}
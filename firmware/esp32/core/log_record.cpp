@@ -0,0 +1,98 @@
+/*
+   Copyright 2024 Scott Bezek and the splitflap contributors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "log_record.h"
+
+#include <stdio.h>
+
+void formatLogRecord(const LogRecord& record, char* buffer, size_t size) {
+    if (size == 0) {
+        return;
+    }
+    const char* format = getLogFormat(record.format_id);
+    if (format == nullptr) {
+        snprintf(buffer, size, "Unknown log format %u", record.format_id);
+        return;
+    }
+
+    size_t length = 0;
+    uint8_t arg_index = 0;
+    const char* p = format;
+    while (*p != '\0' && length < size - 1) {
+        if (*p != '%') {
+            buffer[length++] = *p++;
+            continue;
+        }
+        if (p[1] == '%') {
+            buffer[length++] = '%';
+            p += 2;
+            continue;
+        }
+
+        // Copy a single conversion spec (flags, width, precision and conversion) so it can be passed to snprintf
+        char spec[16];
+        size_t spec_length = 0;
+        spec[spec_length++] = *p++;
+        while (*p != '\0' && strchr("-+ #0123456789.", *p) != nullptr && spec_length < sizeof(spec) - 2) {
+            spec[spec_length++] = *p++;
+        }
+        char conversion = *p;
+        if (conversion == '\0') {
+            break;
+        }
+        p++;
+        spec[spec_length++] = conversion;
+        spec[spec_length] = '\0';
+
+        if (arg_index >= record.arg_count) {
+            // Missing argument
+            buffer[length++] = '?';
+            continue;
+        }
+        uint32_t arg = record.args[arg_index++];
+        int written;
+        switch (conversion) {
+            case 'd':
+            case 'i':
+                written = snprintf(&buffer[length], size - length, spec, (int) (int32_t) arg);
+                break;
+            case 'u':
+            case 'x':
+            case 'X':
+                written = snprintf(&buffer[length], size - length, spec, (unsigned int) arg);
+                break;
+            case 'c':
+                written = snprintf(&buffer[length], size - length, spec, (int) arg);
+                break;
+            case 'f': {
+                float value;
+                memcpy(&value, &arg, sizeof(value));
+                written = snprintf(&buffer[length], size - length, spec, (double) value);
+                break;
+            }
+            default:
+                // Unsupported conversion
+                written = snprintf(&buffer[length], size - length, "?");
+                break;
+        }
+        if (written > 0) {
+            length += written;
+        }
+        if (length > size - 1) {
+            length = size - 1;
+        }
+    }
+    buffer[length] = '\0';
+}
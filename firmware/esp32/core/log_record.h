@@ -0,0 +1,64 @@
+/*
+   Copyright 2024 Scott Bezek and the splitflap contributors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#pragma once
+
+#include <string.h>
+#include <type_traits>
+
+#include <Arduino.h>
+
+#include "log_formats.h"
+
+#define MAX_LOG_ARGS 4
+
+// A structured log message: format ID plus raw arguments, turned into text only where it's consumed
+struct LogRecord {
+    uint32_t timestamp_millis;
+    uint16_t format_id;
+    uint8_t arg_count;
+
+    // Integers are stored as their (sign-extended) 32-bit value, floats as their bit pattern
+    uint32_t args[MAX_LOG_ARGS];
+};
+
+template <typename T>
+inline typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value, uint32_t>::type toLogArg(T value) {
+    return (uint32_t) value;
+}
+
+inline uint32_t toLogArg(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+inline uint32_t toLogArg(double value) {
+    return toLogArg((float) value);
+}
+
+template <typename... Args>
+LogRecord makeLogRecord(LogFormatId format_id, Args... args) {
+    static_assert(sizeof...(Args) <= MAX_LOG_ARGS, "Too many log arguments");
+    return {
+        .timestamp_millis = (uint32_t) millis(),
+        .format_id = format_id,
+        .arg_count = sizeof...(Args),
+        .args = {toLogArg(args)...},
+    };
+}
+
+// Formats record as text into buffer (always null-terminated), like snprintf would have with the same arguments
+void formatLogRecord(const LogRecord& record, char* buffer, size_t size);
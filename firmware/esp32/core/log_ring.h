@@ -0,0 +1,141 @@
+/*
+   Copyright 2024 Scott Bezek and the splitflap contributors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#pragma once
+
+#include <atomic>
+
+#include <Arduino.h>
+
+/**
+ * Bounded lock-free multi-producer/single-consumer ring of variable-length byte entries, for handing log messages
+ * from any task to the serial task without allocating or blocking.
+ *
+ * Producers reserve space with a compare-and-swap on the write position, copy their entry in, then mark it committed.
+ * Entries are never split across the end of the buffer; the space left at the end is skipped with a padding entry. A
+ * producer that finds the ring full drops its entry and counts it. The consumer stops at the first entry that hasn't
+ * been committed yet, so entries are delivered in reservation order.
+ *
+ * Any number of tasks may call push(); exactly one task may call drain().
+ */
+template <uint32_t CAPACITY>
+class LogRing {
+    static_assert(CAPACITY >= 64 && (CAPACITY & (CAPACITY - 1)) == 0, "LogRing capacity must be a power of 2");
+    static_assert(CAPACITY <= 65536, "LogRing entry lengths are 16 bits");
+
+    public:
+        LogRing() {}
+        LogRing(LogRing const&)=delete;
+        LogRing& operator=(LogRing const&)=delete;
+
+        // Largest payload a single entry can hold
+        static const uint16_t MAX_ENTRY_LENGTH = CAPACITY / 4;
+
+        // ---- Producers ----
+
+        /**
+         * Appends an entry of the given type (0-126) and returns true, or returns false and counts a drop if there
+         * isn't room for it.
+         */
+        bool push(uint8_t type, const void* data, uint16_t length) {
+            if (length > MAX_ENTRY_LENGTH) {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            uint32_t size = entrySize(length);
+
+            uint32_t position = head_.load(std::memory_order_relaxed);
+            uint32_t padding;
+            do {
+                uint32_t offset = position & (CAPACITY - 1);
+                padding = offset + size > CAPACITY ? CAPACITY - offset : 0;
+                if (position + padding + size - tail_.load(std::memory_order_acquire) > CAPACITY) {
+                    dropped_.fetch_add(1, std::memory_order_relaxed);
+                    return false;
+                }
+            } while (!head_.compare_exchange_weak(position, position + padding + size, std::memory_order_relaxed));
+
+            if (padding > 0) {
+                commit(position, PADDING, padding - HEADER_SIZE);
+                position += padding;
+            }
+            memcpy(&buffer_[(position & (CAPACITY - 1)) / 4 + 1], data, length);
+            commit(position, type, length);
+            return true;
+        }
+
+        /** Number of entries dropped because the ring was full, since construction (wraps) */
+        uint32_t dropped() const {
+            return dropped_.load(std::memory_order_relaxed);
+        }
+
+        // ---- Consumer ----
+
+        /**
+         * Passes every committed entry, oldest first, to handler(type, data, length) and frees it. data is 4-byte
+         * aligned and only valid during the call. Returns the number of entries handled.
+         */
+        template <typename Handler>
+        uint32_t drain(Handler handler) {
+            uint32_t handled = 0;
+            uint32_t tail = tail_.load(std::memory_order_relaxed);
+            while (tail != head_.load(std::memory_order_acquire)) {
+                uint32_t* header_word = &buffer_[(tail & (CAPACITY - 1)) / 4];
+                uint32_t header = __atomic_load_n(header_word, __ATOMIC_ACQUIRE);
+                if ((header & COMMITTED) == 0) {
+                    // Reserved, but the producer is still writing it
+                    break;
+                }
+                uint8_t type = (header >> 16) & 0x7F;
+                uint16_t length = header & 0xFFFF;
+                if (type != PADDING) {
+                    handler(type, (const uint8_t*) (header_word + 1), length);
+                    handled++;
+                }
+                // Any word of a freed entry may become the header of a later one, which must read as uncommitted until
+                // its producer commits it, so clear all of it
+                uint32_t size = entrySize(length);
+                memset(header_word, 0, size);
+                tail += size;
+
+                // Free each entry as soon as it's handled, since handlers may block on slow serial writes
+                tail_.store(tail, std::memory_order_release);
+            }
+            return handled;
+        }
+
+    private:
+        static const uint8_t PADDING = 0x7F;
+        static const uint32_t COMMITTED = 1u << 31;
+        static const uint32_t HEADER_SIZE = 4;
+
+        static uint32_t entrySize(uint16_t length) {
+            return HEADER_SIZE + ((length + 3u) & ~3u);
+        }
+
+        void commit(uint32_t position, uint8_t type, uint16_t length) {
+            uint32_t header = COMMITTED | ((uint32_t) type << 16) | length;
+            __atomic_store_n(&buffer_[(position & (CAPACITY - 1)) / 4], header, __ATOMIC_RELEASE);
+        }
+
+        // Entries are a header word (committed flag, type and length) followed by the payload, padded to 4 bytes.
+        // Headers are accessed atomically since the consumer polls them while producers write. Free space is all zero.
+        uint32_t buffer_[CAPACITY / 4] = {};
+
+        // Free-running byte positions; only their difference and their offset into buffer_ matter
+        std::atomic<uint32_t> head_ {0};
+        std::atomic<uint32_t> tail_ {0};
+        std::atomic<uint32_t> dropped_ {0};
+};
@@ -15,10 +15,19 @@
 */
 #pragma once
 
+#include "log_record.h"
+
 class Logger {
     public:
         Logger() {};
         virtual ~Logger() {};
         virtual void log(const char* msg) = 0;
+
+        // Loggers that can pass structured records along as-is override this; by default they're formatted as text
+        virtual void logRecord(const LogRecord& record) {
+            char buf[200];
+            formatLogRecord(record, buf, sizeof(buf));
+            log(buf);
+        }
     
 };
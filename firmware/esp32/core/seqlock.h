@@ -0,0 +1,73 @@
+/*
+   Copyright 2024 Scott Bezek and the splitflap contributors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#pragma once
+
+#include <atomic>
+
+#include <Arduino.h>
+
+/**
+ * Single-writer sequence lock for publishing a trivially-copyable value to any number of readers.
+ *
+ * The writer never blocks or waits for readers. Readers never take a lock; they retry their copy if the writer
+ * published concurrently. The sequence number doubles as a generation counter, so readers can cheaply check whether
+ * anything was published since their last copy.
+ */
+template <typename T>
+class Seqlock {
+    public:
+        Seqlock() {}
+        Seqlock(Seqlock const&)=delete;
+        Seqlock& operator=(Seqlock const&)=delete;
+
+        /** Publishes a new value. Must only be called from the single writer task. */
+        void write(const T& value) {
+            uint32_t sequence = sequence_.load(std::memory_order_relaxed);
+            sequence_.store(sequence + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            memcpy(&value_, &value, sizeof(T));
+            sequence_.store(sequence + 2, std::memory_order_release);
+        }
+
+        /** Returns the generation of the latest published value (0 if nothing has been published yet). */
+        uint32_t generation() const {
+            return sequence_.load(std::memory_order_acquire) / 2;
+        }
+
+        /** Copies out a consistent snapshot of the latest value and returns its generation. */
+        uint32_t read(T& out) const {
+            uint8_t attempts = 0;
+            while (1) {
+                uint32_t before = sequence_.load(std::memory_order_acquire);
+                if ((before & 1) == 0) {
+                    memcpy(&out, &value_, sizeof(T));
+                    std::atomic_thread_fence(std::memory_order_acquire);
+                    if (sequence_.load(std::memory_order_relaxed) == before) {
+                        return before / 2;
+                    }
+                }
+                // Writer is mid-update. It's normally running on the other core and finishes within microseconds,
+                // but back off in case it was preempted by this (higher priority) task on the same core.
+                if (++attempts > 10) {
+                    delay(1);
+                }
+            }
+        }
+
+    private:
+        std::atomic<uint32_t> sequence_ {0};
+        T value_;
+};
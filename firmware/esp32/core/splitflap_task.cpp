@@ -28,29 +28,23 @@
 
 static_assert(QCMD_FLAP + NUM_FLAPS <= 255, "Too many flaps to fit in uint8_t command structure");
 
-SplitflapTask::SplitflapTask(const uint8_t task_core, const LedMode led_mode) : Task("Splitflap", 4096, 1, task_core), led_mode_(led_mode), state_semaphore_(xSemaphoreCreateMutex()), configuration_semaphore_(xSemaphoreCreateMutex()) {
-  assert(state_semaphore_ != NULL);
-  xSemaphoreGive(state_semaphore_);
+SplitflapTask::SplitflapTask(const uint8_t task_core, const LedMode led_mode, const uint8_t planner_core) : Task("Splitflap", 4096, 1, task_core), led_mode_(led_mode), configuration_semaphore_(xSemaphoreCreateMutex()), planner_(*this, planner_core) {
   assert(configuration_semaphore_ != NULL);
   xSemaphoreGive(configuration_semaphore_);
-
-  queue_ = xQueueCreate(5, sizeof(Command));
-  assert(queue_ != NULL);
 }
 
 SplitflapTask::~SplitflapTask() {
-  if (queue_ != NULL) {
-    vQueueDelete(queue_);
-  }
-  if (state_semaphore_ != NULL) {
-    vSemaphoreDelete(state_semaphore_);
-  }
   if (configuration_semaphore_ != NULL) {
     vSemaphoreDelete(configuration_semaphore_);
   }
 }
 
 
+void SplitflapTask::begin() {
+    Task<SplitflapTask>::begin();
+    planner_.begin();
+}
+
 void SplitflapTask::run() {
     esp_err_t result = esp_task_wdt_add(NULL);
     ESP_ERROR_CHECK(result);
@@ -65,6 +59,16 @@ void SplitflapTask::run() {
     digitalWrite(OUTPUT_ENABLE_PIN, LOW);
 #endif
 
+#if CHAINLINK_DETECT_CHAIN_LENGTH
+    uint8_t detected_modules = chainlink_detect_num_modules();
+    if (detected_modules == 0) {
+        log(LOG_CHAIN_NOT_DETECTED);
+    } else {
+        chainlink_set_num_modules(detected_modules);
+        log(LOG_CHAIN_DETECTED, detected_modules, NUM_MODULES);
+    }
+#endif
+
 #if (defined(CHAINLINK) && !defined(CHAINLINK_DRIVER_TESTER))
 #if CHAINLINK_ENFORCE_LOOPBACKS
     bool loopback_result[NUM_LOOPBACKS][NUM_LOOPBACKS];
@@ -72,20 +76,16 @@ void SplitflapTask::run() {
     bool loopback_success = chainlink_test_all_loopbacks(loopback_result, loopback_off_result);
 
     if (!loopback_success) {
-      for (uint8_t i = 0; i < NUM_LOOPBACKS; i++) {
-        for (uint8_t j = 0; j < NUM_LOOPBACKS; j++) {
+      for (uint8_t i = 0; i < chainlink_num_loopbacks(); i++) {
+        for (uint8_t j = 0; j < chainlink_num_loopbacks(); j++) {
           if (!loopback_result[i][j]) {
-            char buffer[200] = {};
-            snprintf(buffer, sizeof(buffer), "Loopback ERROR. Set output %u but read incorrect value at input %u", i, j);
-            log(buffer);
+            log(LOG_LOOPBACK_INCORRECT, i, j);
           }
         }
       }
-      for (uint8_t j = 0; j < NUM_LOOPBACKS; j++) {
+      for (uint8_t j = 0; j < chainlink_num_loopbacks(); j++) {
         if (!loopback_off_result[j]) {
-            char buffer[200] = {};
-            snprintf(buffer, sizeof(buffer), "Loopback ERROR. Loopback %u was set when all outputs off - should have been 0", j);
-            log(buffer);
+            log(LOG_LOOPBACK_SET_WHEN_OFF, j);
         }
       }
 
@@ -96,7 +96,7 @@ void SplitflapTask::run() {
 #endif
 
     if (led_mode_ == LedMode::AUTO) {
-        for (uint8_t i = 0; i < NUM_MODULES; i++) {
+        for (uint8_t i = 0; i < num_modules; i++) {
             chainlink_set_led(i, 1);
             motor_sensor_io();
             delay(10);
@@ -108,150 +108,260 @@ void SplitflapTask::run() {
     }
 #endif
 
-    for (uint8_t i = 0; i < NUM_MODULES; i++) {
+    for (uint8_t i = 0; i < num_modules; i++) {
         modules[i]->Init();
 #if !defined(CHAINLINK_DRIVER_TESTER) && !defined(CHAINLINK_BASE)
         modules[i]->FindAndRecalibrateHome();
 #endif
     }
 
+    loop_stats_window_start_millis_ = millis();
+#if MOTION_FIXED_TICK
+    runFixedTickLoop();
+#else
     while(1) {
-        processQueue();
-        runUpdate();
+        uint32_t iteration_start_micros = micros();
+        if (disable_requested_.load(std::memory_order_acquire)) {
+            handleDisableRequest();
+        }
+        processPlans();
+        bool stepped = runUpdate();
         result = esp_task_wdt_reset();
         ESP_ERROR_CHECK(result);
+        updateLoopStats(micros() - iteration_start_micros, stepped);
     }
+#endif
 }
 
-void SplitflapTask::processQueue() {
-    if (xQueueReceive(queue_, &queue_receive_buffer_, 0) == pdTRUE) {
-        switch (queue_receive_buffer_.command_type) {
-            case CommandType::MODULES: {
-                uint8_t* data = queue_receive_buffer_.data.module_command;
-                bool any_leds = false;
-                for (uint8_t i = 0; i < NUM_MODULES; i++) {
-                    switch (data[i]) {
-                        case QCMD_NO_OP:
-                            // No-op
-                            break;
-                        case QCMD_RESET_AND_HOME:
-                            modules[i]->ResetState();
-                            modules[i]->FindAndRecalibrateHome();
-                            break;
-                        case QCMD_LED_ON:
-                            any_leds = true;
-    #ifdef CHAINLINK
-                            chainlink_set_led(i, true);
-    #endif
-                            break;
-                        case QCMD_LED_OFF:
-                            any_leds = true;
-    #ifdef CHAINLINK
-                            chainlink_set_led(i, false);
-    #endif
-                            break;
-                        case QCMD_DISABLE:
-                            modules[i]->Disable();
-                            break;
-                        case QCMD_INCR_OFFSET_TENTH:
-                            modules[i]->IncreaseOffset(1);
-                            break;
-                        case QCMD_INCR_OFFSET_HALF:
-                            modules[i]->IncreaseOffset(5);
-                            break;
-                        case QCMD_SET_OFFSET:
-                            modules[i]->SetOffset();
-                            break;
-                        default:
-                            assert(data[i] >= QCMD_FLAP && data[i] < QCMD_FLAP + NUM_FLAPS);
-                            modules[i]->GoToFlapIndex(data[i] - QCMD_FLAP);
-                            break;
-                    }
-                }
-                if (any_leds) {
-                    motor_sensor_io();
-                }
+#if MOTION_FIXED_TICK
+// Besides stepping and I/O, which happen every tick, each tick does one of these, in turn. This keeps the work done
+// in any single tick bounded.
+enum TickSlot : uint8_t {
+    TICK_SLOT_PLANS,
+    TICK_SLOT_LOOPBACK,
+    TICK_SLOT_STATE,
+    NUM_TICK_SLOTS,
+};
+
+static TaskHandle_t motion_tick_task = nullptr;
+
+static void IRAM_ATTR onMotionTick() {
+    BaseType_t higher_priority_task_woken = pdFALSE;
+    vTaskNotifyGiveFromISR(motion_tick_task, &higher_priority_task_woken);
+    if (higher_priority_task_woken) {
+        portYIELD_FROM_ISR();
+    }
+}
+
+void SplitflapTask::runFixedTickLoop() {
+    motion_tick_task = xTaskGetCurrentTaskHandle();
+
+    // Count microseconds (80MHz APB clock / 80)
+    hw_timer_t* timer = timerBegin(MOTION_TICK_TIMER, 80, true);
+    timerAttachInterrupt(timer, &onMotionTick, true);
+    timerAlarmWrite(timer, MOTION_TICK_MICROS, true);
+    timerAlarmEnable(timer);
+
+    // Modules are stepped on the ideal tick times rather than whenever the task happened to wake up
+    uint32_t tick_micros = micros();
+    uint8_t slot = 0;
+    while(1) {
+        uint32_t ticks = ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        uint32_t tick_start_micros = micros();
+
+        // More than one tick pending means the previous tick overran. Skip the missed ticks rather than trying to
+        // catch up with a burst of steps.
+        loop_tick_overruns_ += ticks - 1;
+        tick_micros += ticks * MOTION_TICK_MICROS;
+
+        if (disable_requested_.load(std::memory_order_acquire)) {
+            handleDisableRequest();
+        }
+        bool stepped = updateModules(tick_micros);
+
+        switch (slot) {
+            case TICK_SLOT_PLANS:
+                processPlans();
                 break;
-            }
-            case CommandType::SENSOR_TEST_SET:
-                sensor_test_ = true;
+            case TICK_SLOT_LOOPBACK:
+                updateLoopback();
                 break;
-            case CommandType::SENSOR_TEST_CLEAR:
-                sensor_test_ = false;
+            case TICK_SLOT_STATE:
+                publishSnapshot();
                 break;
-            case CommandType::CONFIG: {
-                ModuleConfigs configs = queue_receive_buffer_.data.module_configs;
-                for (uint8_t i = 0; i < NUM_MODULES; i++) {
-                    ModuleConfig config = configs.config[i];
-
-                    if (config.reset_nonce != current_configs_.config[i].reset_nonce) {
-                        modules[i]->ResetErrorCounters();
-                        modules[i]->FindAndRecalibrateHome();
-                    }
-
-                    if (config.target_flap_index != current_configs_.config[i].target_flap_index ||
-                            config.target_flap_index != modules[i]->GetTargetFlapIndex() ||
-                            config.movement_nonce != current_configs_.config[i].movement_nonce) {
-                        if (config.target_flap_index >= NUM_FLAPS) {
-                            char buffer[200] = {};
-                            snprintf(buffer, sizeof(buffer), "Invalid flap index (%u) specified for module %u", config.target_flap_index, i);
-                            log(buffer);
-                        } else {
-                            modules[i]->GoToFlapIndex(config.target_flap_index);
-                        }
-                    }
-                }
-                current_configs_ = configs;
+            default:
                 break;
-            }
-            case CommandType::SAVE_ALL_OFFSETS: {
-                char buffer[200] = {};
-
-                uint16_t offsets[NUM_MODULES];
-                for (uint8_t i = 0; i < NUM_MODULES; i++) {
-                    // Make sure all modules are stopped, since writing to config may take a while
-                    if (modules[i]->current_accel_step != 0) {
-                        snprintf(buffer, sizeof(buffer), "Can't save offsets; module %u isn't idle", i);
-                        log(buffer);
-                        return;
-                    }
+        }
+        slot = (slot + 1) % NUM_TICK_SLOTS;
 
-                    offsets[i] = modules[i]->GetOffset();
-                }
+        esp_err_t result = esp_task_wdt_reset();
+        ESP_ERROR_CHECK(result);
+        updateLoopStats(micros() - tick_start_micros, stepped);
+    }
+}
+#endif
 
-                // Write to configuration
-                Configuration* configuration;
-                {
-                    SemaphoreGuard lock(configuration_semaphore_);
-                    configuration = configuration_;
-                }
-                if (configuration != nullptr) {
-                    log("Saving calibration...");
-                    bool success = configuration->setModuleOffsetsAndSave(offsets);
-                    if (success) {
-                        log("SUCCESS - saved calibration!");
-                    } else {
-                        log("ERROR - failed to save calibration");
-                    }
-                }
+void SplitflapTask::updateLoopStats(uint32_t iteration_micros, bool stepped) {
+    loop_iterations_++;
+    if (stepped) {
+        loop_step_iterations_++;
+    }
+    if (iteration_micros > loop_max_iteration_micros_) {
+        loop_max_iteration_micros_ = iteration_micros;
+    }
+
+    uint32_t now = millis();
+    uint32_t elapsed_millis = now - loop_stats_window_start_millis_;
+    if (elapsed_millis < LOOP_STATS_WINDOW_MILLIS) {
+        return;
+    }
+
+    LoopStats stats;
+    stats.iterations_per_second = (uint64_t)loop_iterations_ * 1000 / elapsed_millis;
+    stats.max_iteration_micros = loop_max_iteration_micros_;
+    stats.command_queue_high_water = commands_high_water_.exchange(0, std::memory_order_relaxed);
+    stats.step_iteration_permille = (uint64_t)loop_step_iterations_ * 1000 / loop_iterations_;
+    stats.tick_overruns = loop_tick_overruns_;
+    loop_stats_.write(stats);
+
+    loop_stats_window_start_millis_ = now;
+    loop_iterations_ = 0;
+    loop_step_iterations_ = 0;
+    loop_max_iteration_micros_ = 0;
+    loop_tick_overruns_ = 0;
+}
+
+void SplitflapTask::handleDisableRequest() {
+    disable_requested_.store(0, std::memory_order_relaxed);
+
+    for (uint8_t i = 0; i < NUM_MODULES; i++) {
+        modules[i]->Disable();
+    }
+    // Get power off the coils right away rather than waiting for the next update
+    motor_sensor_io();
+    log(LOG_DISABLED_ALL);
+}
+
+void SplitflapTask::processPlans() {
+    // Plans are already coalesced by the planner, so there is rarely more than one waiting. Bound the work anyway so
+    // a burst can't stall the motion loop.
+    for (uint8_t i = 0; i < PLAN_RING_DEPTH; i++) {
+        MotionPlan* plan = plans_.peek();
+        if (plan == nullptr) {
+            break;
+        }
+        applyPlan(*plan);
+        publishAppliedCommands(*plan);
+        plans_.pop();
+    }
+
+    if (leds_changed_) {
+        motor_sensor_io();
+        leds_changed_ = false;
+    }
+}
+
+void SplitflapTask::applyPlan(const MotionPlan& plan) {
+    switch (plan.plan_type) {
+        case PlanType::MODULE_ACTIONS:
+            for (uint8_t i = 0; i < num_modules; i++) {
+                applyModuleAction(i, plan.data.actions[i]);
+            }
+            break;
+        case PlanType::SENSOR_TEST_SET:
+            sensor_test_ = true;
+            break;
+        case PlanType::SENSOR_TEST_CLEAR:
+            sensor_test_ = false;
+            break;
+        case PlanType::SAVE_ALL_OFFSETS: {
+            if (offsets_to_save_ready_.load(std::memory_order_acquire)) {
+                log(LOG_SAVE_OFFSETS_IN_PROGRESS);
                 break;
             }
-            case CommandType::RESTORE_ALL_OFFSETS:
-                for (uint8_t i = 0; i < NUM_MODULES; i++) {
-                    uint16_t offset = queue_receive_buffer_.data.module_offsets[i];
-                    modules[i]->RestoreOffset(offset);
+            for (uint8_t i = 0; i < NUM_MODULES; i++) {
+                // Make sure all modules are stopped, since writing to config may take a while
+                if (modules[i]->current_accel_step != 0) {
+                    log(LOG_SAVE_OFFSETS_NOT_IDLE, i);
+                    return;
                 }
-                break;
-            default: {
-                log("Unknown command");
-                break;
+                offsets_to_save_[i] = modules[i]->GetOffset();
             }
+            // The planner hands these to the configuration task, which does the (slow) write to flash
+            offsets_to_save_ready_.store(1, std::memory_order_release);
+            xTaskNotifyGive(planner_.getHandle());
+            break;
         }
+        case PlanType::RESTORE_ALL_OFFSETS:
+            for (uint8_t i = 0; i < NUM_MODULES; i++) {
+                modules[i]->RestoreOffset(plan.data.module_offsets[i]);
+            }
+            break;
+        default:
+            log(LOG_UNKNOWN_PLAN);
+            break;
+    }
+}
+
+void SplitflapTask::applyModuleAction(uint8_t module, uint8_t action) {
+    if (action == QCMD_NO_OP) {
+        return;
+    }
+    if (action >= QCMD_FLAP) {
+        assert(action < QCMD_FLAP + NUM_FLAPS);
+        modules[module]->GoToFlapIndex(action - QCMD_FLAP);
+        return;
+    }
+
+    switch (action) {
+        case QCMD_RESET_AND_HOME:
+            modules[module]->ResetState();
+            modules[module]->FindAndRecalibrateHome();
+            break;
+        case QCMD_RECALIBRATE:
+            modules[module]->ResetErrorCounters();
+            modules[module]->FindAndRecalibrateHome();
+            break;
+        case QCMD_LED_ON:
+            leds_changed_ = true;
+#ifdef CHAINLINK
+            chainlink_set_led(module, true);
+#endif
+            break;
+        case QCMD_LED_OFF:
+            leds_changed_ = true;
+#ifdef CHAINLINK
+            chainlink_set_led(module, false);
+#endif
+            break;
+        case QCMD_DISABLE:
+            modules[module]->Disable();
+            break;
+        case QCMD_INCR_OFFSET_TENTH:
+            modules[module]->IncreaseOffset(1);
+            break;
+        case QCMD_INCR_OFFSET_HALF:
+            modules[module]->IncreaseOffset(5);
+            break;
+        case QCMD_SET_OFFSET:
+            modules[module]->SetOffset();
+            break;
+        default:
+            log(LOG_UNKNOWN_MODULE_ACTION);
+            break;
     }
 }
 
-void SplitflapTask::runUpdate() {
+bool SplitflapTask::runUpdate() {
+    bool stepped = updateModules(micros());
+    updateLoopback();
+    publishSnapshot();
+    return stepped;
+}
+
+bool SplitflapTask::updateModules(uint32_t now_micros) {
     boolean all_idle = true;
+    bool stepped = false;
 
     uint32_t iterationStartMillis = millis();
 
@@ -265,7 +375,7 @@ void SplitflapTask::runUpdate() {
 
 #ifdef CHAINLINK
       if (led_mode_ == LedMode::AUTO) {
-        for (uint8_t i = 0; i < NUM_MODULES; i++) {
+        for (uint8_t i = 0; i < num_modules; i++) {
           chainlink_set_led(i, modules[i]->GetHomeState());
         }
         // Output LED state
@@ -274,8 +384,8 @@ void SplitflapTask::runUpdate() {
 #endif
     } else {
       all_stopped_ = true;
-      for (uint8_t i = 0; i < NUM_MODULES; i++) {
-        modules[i]->Update();
+      for (uint8_t i = 0; i < num_modules; i++) {
+        stepped |= modules[i]->Update(now_micros);
         bool is_idle = modules[i]->state == PANIC
           || modules[i]->state == STATE_DISABLED
           || modules[i]->state == LOOK_FOR_HOME
@@ -297,8 +407,10 @@ void SplitflapTask::runUpdate() {
       }
       motor_sensor_io();
     }
+    return stepped;
+}
 
-
+void SplitflapTask::updateLoopback() {
 #if defined(CHAINLINK) && CHAINLINK_ENFORCE_LOOPBACKS
     // We test loopbacks iteratively, so as not to waste too many cycles/IO-roundtrips all at once. There are
     // two levels of iteration - loopback_step_index_ tracks the small intermediate steps of testing a single
@@ -313,7 +425,7 @@ void SplitflapTask::runUpdate() {
       if (!ok && loopback_all_ok_) {
         // Publish failures immediately
         loopback_all_ok_ = false;
-        log("Loopback ERROR!");
+        log(LOG_LOOPBACK_ERROR);
         disableAll();
       }
     } else if (loopback_step_index_ == 50) {
@@ -322,9 +434,9 @@ void SplitflapTask::runUpdate() {
 
       // If we've iterated through all loopbacks, save the results of this run and restart
       // from the first loopback again.
-      if (loopback_current_out_index_ >= NUM_LOOPBACKS) {
+      if (loopback_current_out_index_ >= chainlink_num_loopbacks()) {
         if (loopback_current_ok_ && !loopback_all_ok_) {
-            log("Loopback is ok!");
+            log(LOG_LOOPBACK_OK);
         }
         loopback_all_ok_ = loopback_current_ok_;
         loopback_current_ok_ = true;
@@ -333,8 +445,6 @@ void SplitflapTask::runUpdate() {
     }
     // TODO: handle loopback failures
 #endif
-
-    updateStateCache();
 }
 
 int8_t SplitflapTask::findFlapIndex(uint8_t character) {
@@ -346,105 +456,431 @@ int8_t SplitflapTask::findFlapIndex(uint8_t character) {
     return -1;
 }
 
+void SplitflapTask::publishSnapshot() {
+    uint32_t now = micros();
+    if (now - last_snapshot_micros_ < STATE_SNAPSHOT_INTERVAL_MICROS) {
+        return;
+    }
+    last_snapshot_micros_ = now;
+
+    // Only copy out the raw state here; comparing and publishing it is left to the planner
+    SplitflapState snapshot = {};
+    snapshot.mode = sensor_test_ ? SplitflapMode::MODE_SENSOR_TEST : SplitflapMode::MODE_RUN;
+    snapshot.num_modules = num_modules;
+    for (uint8_t i = 0; i < num_modules; i++) {
+      snapshot.modules[i].flap_index = modules[i]->GetCurrentFlapIndex();
+      snapshot.modules[i].state = modules[i]->state;
+      snapshot.modules[i].moving = modules[i]->current_accel_step > 0;
+      snapshot.modules[i].home_state = modules[i]->GetHomeState();
+      snapshot.modules[i].count_missed_home = modules[i]->count_missed_home;
+      snapshot.modules[i].count_unexpected_home = modules[i]->count_unexpected_home;
+    }
+#ifdef CHAINLINK
+    snapshot.loopbacks_ok = loopback_all_ok_;
+#endif
+    snapshot_.write(snapshot);
+    xTaskNotifyGive(planner_.getHandle());
+}
+
+void SplitflapTask::runPlanner() {
+    memset(planned_targets_, PLANNED_TARGET_UNKNOWN, sizeof(planned_targets_));
+    while(1) {
+        // Woken by submitted commands, new snapshots from the executor and offsets ready to be saved
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100));
+
+        planCommands();
+        if (offsets_to_save_ready_.load(std::memory_order_acquire)) {
+            saveOffsets();
+            offsets_to_save_ready_.store(0, std::memory_order_release);
+        }
+        reportSaveCompletion();
+        updateStateCache();
+    }
+}
+
+void SplitflapTask::planCommands() {
+    // Drain everything pending from every producer into as few plans as possible. Only the latest flap target per
+    // module is kept, so a burst of updates costs the executor one plan rather than one per command. Each ring is
+    // drained at most once per pass, so one busy producer can't hold up state publication; anything left over was
+    // submitted after this pass started, and its notification wakes the planner again.
+    uint32_t processed = 0;
+    uint32_t sequences[MAX_COMMAND_PRODUCERS] = {};
+    for (uint8_t p = 0; p < MAX_COMMAND_PRODUCERS; p++) {
+        CommandProducer& producer = producers_[p];
+        if (producer.owner.load(std::memory_order_acquire) == nullptr) {
+            continue;
+        }
+        for (uint8_t i = 0; i < COMMAND_RING_DEPTH; i++) {
+            Command* command = producer.ring.peek();
+            if (command == nullptr) {
+                break;
+            }
+            planCommand(*command);
+            sequences[p] = command->sequence;
+            producer.ring.pop();
+            processed++;
+        }
+    }
+
+    if (processed > 0) {
+        // Plans are applied in order, so the last one marks when everything drained in this pass has been applied.
+        // Commands that didn't change anything still need a (no-op) plan to mark them.
+        MotionPlan& plan = plan_ != nullptr ? *plan_ : beginPlan(PlanType::MODULE_ACTIONS);
+        for (uint8_t p = 0; p < MAX_COMMAND_PRODUCERS; p++) {
+            if (sequences[p] != 0) {
+                plan.command_sequences[p] = sequences[p];
+            }
+        }
+    }
+    flushPlan();
+
+    uint32_t high_water = commands_high_water_.load(std::memory_order_relaxed);
+    if (processed > high_water) {
+        commands_high_water_.store(processed, std::memory_order_relaxed);
+    }
+}
+
+void SplitflapTask::planCommand(const Command& command) {
+    switch (command.command_type) {
+        case CommandType::MODULES: {
+            const uint8_t* data = command.data.module_command;
+            for (uint8_t i = 0; i < num_modules; i++) {
+                planModuleAction(i, data[i]);
+            }
+            break;
+        }
+        case CommandType::MODULE_ACTIONS: {
+            const ModuleActions& module_actions = command.data.module_actions;
+            for (uint8_t i = 0; i < module_actions.count; i++) {
+                if (module_actions.actions[i].module < num_modules) {
+                    planModuleAction(module_actions.actions[i].module, module_actions.actions[i].action);
+                }
+            }
+            break;
+        }
+        case CommandType::SENSOR_TEST_SET:
+            beginPlan(PlanType::SENSOR_TEST_SET);
+            break;
+        case CommandType::SENSOR_TEST_CLEAR:
+            beginPlan(PlanType::SENSOR_TEST_CLEAR);
+            break;
+        case CommandType::CONFIG: {
+            const ModuleConfigs& configs = command.data.module_configs;
+            for (uint8_t i = 0; i < num_modules; i++) {
+                ModuleConfig config = configs.config[i];
+
+                if (config.reset_nonce != current_configs_.config[i].reset_nonce) {
+                    planModuleAction(i, QCMD_RECALIBRATE);
+                }
+
+                if (config.target_flap_index != current_configs_.config[i].target_flap_index ||
+                        config.target_flap_index != planned_targets_[i] ||
+                        config.movement_nonce != current_configs_.config[i].movement_nonce) {
+                    if (config.target_flap_index >= NUM_FLAPS) {
+                        log(LOG_INVALID_FLAP_INDEX, config.target_flap_index, i);
+                    } else {
+                        planModuleAction(i, QCMD_FLAP + config.target_flap_index);
+                    }
+                }
+            }
+            current_configs_ = configs;
+            break;
+        }
+        case CommandType::SAVE_ALL_OFFSETS:
+            beginPlan(PlanType::SAVE_ALL_OFFSETS);
+            break;
+        case CommandType::RESTORE_ALL_OFFSETS: {
+            MotionPlan& plan = beginPlan(PlanType::RESTORE_ALL_OFFSETS);
+            memcpy(plan.data.module_offsets, command.data.module_offsets, sizeof(plan.data.module_offsets));
+            break;
+        }
+        default: {
+            log(LOG_UNKNOWN_COMMAND);
+            break;
+        }
+    }
+}
+
+void SplitflapTask::planModuleAction(uint8_t module, uint8_t action) {
+    if (action == QCMD_NO_OP) {
+        return;
+    }
+
+    MotionPlan* plan = &beginPlan(PlanType::MODULE_ACTIONS);
+    uint8_t planned_action = plan->data.actions[module];
+    bool supersedes = action >= QCMD_FLAP && planned_action >= QCMD_FLAP;
+    if (planned_action != QCMD_NO_OP && !supersedes) {
+        // The module already has an action in this plan that must happen first, so start a new plan. The plan just
+        // published mustn't be reclaimed, or the new action would overwrite the one it has to follow.
+        flushPlan();
+        plan = &beginPlan(PlanType::MODULE_ACTIONS, false);
+    }
+    plan->data.actions[module] = action;
+
+    if (action >= QCMD_FLAP) {
+        planned_targets_[module] = action - QCMD_FLAP;
+    } else if (action == QCMD_RESET_AND_HOME) {
+        planned_targets_[module] = 0;
+    } else if (action == QCMD_RECALIBRATE) {
+        // A module in an error state ignores targets until it has been homed, so resend the next target
+        planned_targets_[module] = PLANNED_TARGET_UNKNOWN;
+    }
+}
+
+MotionPlan& SplitflapTask::beginPlan(PlanType plan_type, bool allow_reclaim) {
+    if (plan_ != nullptr) {
+        if (plan_type == PlanType::MODULE_ACTIONS && plan_->plan_type == PlanType::MODULE_ACTIONS) {
+            return *plan_;
+        }
+        flushPlan();
+    }
+
+    if (plan_type == PlanType::MODULE_ACTIONS && allow_reclaim) {
+        // Keep adding to the newest plan if the executor hasn't picked it up yet; planModuleAction() starts a new
+        // plan for any action that conflicts with one already in it
+        plan_ = plans_.reclaimNewest();
+        if (plan_ != nullptr) {
+            if (plan_->plan_type == PlanType::MODULE_ACTIONS) {
+                return *plan_;
+            }
+            // Hand it back untouched
+            plans_.publish();
+        }
+    }
+
+    plan_ = plans_.reserve();
+    while (plan_ == nullptr) {
+        // The executor consumes plans every iteration, so it's never full for long
+        delay(1);
+        plan_ = plans_.reserve();
+    }
+    plan_->plan_type = plan_type;
+    memset(plan_->command_sequences, 0, sizeof(plan_->command_sequences));
+    if (plan_type == PlanType::MODULE_ACTIONS) {
+        memset(plan_->data.actions, QCMD_NO_OP, sizeof(plan_->data.actions));
+    }
+    return *plan_;
+}
+
+void SplitflapTask::flushPlan() {
+    if (plan_ != nullptr) {
+        plans_.publish();
+        plan_ = nullptr;
+    }
+}
+
+void SplitflapTask::publishAppliedCommands(const MotionPlan& plan) {
+    uint32_t now = micros();
+    for (uint8_t p = 0; p < MAX_COMMAND_PRODUCERS; p++) {
+        if (plan.command_sequences[p] != 0) {
+            producers_[p].applied.write({plan.command_sequences[p], now});
+        }
+    }
+}
+
+void SplitflapTask::saveOffsets() {
+    Configuration* configuration;
+    {
+        SemaphoreGuard lock(configuration_semaphore_);
+        configuration = configuration_;
+    }
+    if (configuration != nullptr) {
+        log(LOG_SAVING_CALIBRATION);
+        // Only queues the save; the configuration task writes to flash and reportSaveCompletion() picks up the result
+        pending_save_id_ = configuration->setModuleOffsetsAndSave(offsets_to_save_);
+    }
+}
+
+void SplitflapTask::reportSaveCompletion() {
+    if (pending_save_id_ == 0) {
+        return;
+    }
+    Configuration* configuration;
+    {
+        SemaphoreGuard lock(configuration_semaphore_);
+        configuration = configuration_;
+    }
+    if (configuration == nullptr) {
+        return;
+    }
+    SaveStatus status = configuration->getSaveStatus();
+    if ((int32_t)(status.completed - pending_save_id_) < 0) {
+        return;
+    }
+    if (status.success) {
+        log(LOG_SAVED_CALIBRATION);
+    } else {
+        log(LOG_SAVE_CALIBRATION_FAILED);
+    }
+    pending_save_id_ = 0;
+}
+
 void SplitflapTask::updateStateCache() {
+    if (snapshot_.generation() == snapshot_generation_) {
+        return;
+    }
     SplitflapState new_state;
-    new_state.mode = sensor_test_ ? SplitflapMode::MODE_SENSOR_TEST : SplitflapMode::MODE_RUN;
-    for (uint8_t i = 0; i < NUM_MODULES; i++) {
-      new_state.modules[i].flap_index = modules[i]->GetCurrentFlapIndex();
-      new_state.modules[i].state = modules[i]->state;
-      new_state.modules[i].moving = modules[i]->current_accel_step > 0;
-      new_state.modules[i].home_state = modules[i]->GetHomeState();
-      new_state.modules[i].count_missed_home = modules[i]->count_missed_home;
-      new_state.modules[i].count_unexpected_home = modules[i]->count_unexpected_home;
+    snapshot_generation_ = snapshot_.read(new_state);
+
+    ModuleMask changed_modules = {};
+    bool any_module_changed = false;
+    for (uint8_t i = 0; i < new_state.num_modules; i++) {
+      if (new_state.modules[i] != state_cache_.modules[i]) {
+        changed_modules.set(i);
+        any_module_changed = true;
+      }
     }
 
+    bool other_changed = new_state.mode != state_cache_.mode
+        || new_state.num_modules != state_cache_.num_modules
 #ifdef CHAINLINK
-    new_state.loopbacks_ok = loopback_all_ok_;
+        || new_state.loopbacks_ok != state_cache_.loopbacks_ok
 #endif
-    if (memcmp(&state_cache_, &new_state, sizeof(state_cache_))) {
-        SemaphoreGuard lock(state_semaphore_);
+        ;
+    if (any_module_changed || other_changed) {
         memcpy(&state_cache_, &new_state, sizeof(state_cache_));
+        state_.write(state_cache_);
+        notifyStateListeners(changed_modules, other_changed);
     }
 }
 
-void SplitflapTask::log(const char* msg) {
-    if (logger_ != nullptr) {
-        logger_->log(msg);
+void SplitflapTask::notifyStateListeners(const ModuleMask& changed_modules, bool other_changed) {
+    for (uint8_t i = 0; i < MAX_STATE_LISTENERS; i++) {
+        StateListener& listener = state_listeners_[i];
+        TaskHandle_t task = listener.task.load(std::memory_order_acquire);
+        if (task == nullptr) {
+            continue;
+        }
+        for (uint8_t w = 0; w < MODULE_MASK_WORDS; w++) {
+            if (changed_modules.words[w]) {
+                listener.changed_modules[w].fetch_or(changed_modules.words[w], std::memory_order_release);
+            }
+        }
+        if (other_changed) {
+            listener.other_changed.store(1, std::memory_order_release);
+        }
+        xTaskNotifyGive(task);
+    }
+}
+
+void SplitflapTask::addStateListener() {
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    for (uint8_t i = 0; i < MAX_STATE_LISTENERS; i++) {
+        StateListener& listener = state_listeners_[i];
+        if (listener.task.load(std::memory_order_acquire) == nullptr) {
+            for (uint8_t w = 0; w < MODULE_MASK_WORDS; w++) {
+                listener.changed_modules[w].store(0, std::memory_order_relaxed);
+            }
+            listener.other_changed.store(0, std::memory_order_relaxed);
+            TaskHandle_t expected = nullptr;
+            if (listener.task.compare_exchange_strong(expected, task, std::memory_order_acq_rel)) {
+                return;
+            }
+        }
+    }
+    assert(false && "Too many state listeners; increase MAX_STATE_LISTENERS");
+}
+
+bool SplitflapTask::waitForStateChange(TickType_t timeout, ModuleMask& changed_modules) {
+    ulTaskNotifyTake(pdTRUE, timeout);
+
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    for (uint8_t i = 0; i < MAX_STATE_LISTENERS; i++) {
+        StateListener& listener = state_listeners_[i];
+        if (listener.task.load(std::memory_order_acquire) != task) {
+            continue;
+        }
+        // Take changes before reading the state, so a concurrent change is at worst reported twice, never missed
+        bool changed = listener.other_changed.exchange(0, std::memory_order_acquire);
+        for (uint8_t w = 0; w < MODULE_MASK_WORDS; w++) {
+            changed_modules.words[w] = listener.changed_modules[w].exchange(0, std::memory_order_acquire);
+            changed |= changed_modules.words[w] != 0;
+        }
+        return changed;
     }
+    assert(false && "waitForStateChange called from a task that isn't a state listener");
+    return false;
 }
 
 void SplitflapTask::showString(const char* str, uint8_t length, bool force_full_rotation, bool default_unspecified_home) {
-    Command command = {};
-    command.command_type = CommandType::MODULES;
-    uint8_t num_to_update = default_unspecified_home ? NUM_MODULES : length;
-    for (uint8_t i = 0; i < num_to_update && i < NUM_MODULES; i++) {
+    Command* command = beginCommand(CommandType::MODULES, SubmitPolicy::MERGE);
+    if (command == nullptr) {
+        log(LOG_DROPPED_SHOW_STRING);
+        return;
+    }
+    // Only the detected modules; characters beyond them have nowhere to go. The count is read from the published state,
+    // since this runs on the caller's task. Until the first state is published, the planner drops extra modules.
+    uint8_t detected_modules = getState().num_modules;
+    uint8_t max_modules = detected_modules > 0 ? detected_modules : NUM_MODULES;
+    uint8_t num_to_update = default_unspecified_home ? max_modules : length;
+    for (uint8_t i = 0; i < num_to_update && i < max_modules; i++) {
         int8_t index = i >= length ? 0 : findFlapIndex(str[i]);
         if (index != -1) {
             if (force_full_rotation || index != modules[i]->GetTargetFlapIndex()) {
-                command.data.module_command[i] = QCMD_FLAP + index;
+                command->data.module_command[i] = QCMD_FLAP + index;
+            } else {
+                // Already headed there; also drop any target left by an earlier string merged into this command
+                command->data.module_command[i] = QCMD_NO_OP;
             }
         }
     }
-    assert(xQueueSendToBack(queue_, &command, portMAX_DELAY) == pdTRUE);
+    submitCommand(true);
 }
 
 void SplitflapTask::resetAll() {
-    Command command = {};
-    command.command_type = CommandType::MODULES;
+    Command* command = beginCommand(CommandType::MODULES, SubmitPolicy::WAIT);
     for (uint8_t i = 0; i < NUM_MODULES; i++) {
-        command.data.module_command[i] = QCMD_RESET_AND_HOME;
+        command->data.module_command[i] = QCMD_RESET_AND_HOME;
     }
-    assert(xQueueSendToBack(queue_, &command, portMAX_DELAY) == pdTRUE);
+    submitCommand();
 }
 
 void SplitflapTask::disableAll() {
-    Command command = {};
-    command.command_type = CommandType::MODULES;
-    for (uint8_t i = 0; i < NUM_MODULES; i++) {
-        command.data.module_command[i] = QCMD_DISABLE;
-    }
-    assert(xQueueSendToBack(queue_, &command, portMAX_DELAY) == pdTRUE);
+    // Bypasses the command queues so it never blocks and is never stuck behind other commands
+    disable_requested_.store(1, std::memory_order_release);
 }
 
 void SplitflapTask::setLed(const uint8_t id, const bool on) {
     assert(led_mode_ == LedMode::MANUAL);
 
-    Command command = {};
-    command.command_type = CommandType::MODULES;
-    command.data.module_command[id] = on ? QCMD_LED_ON : QCMD_LED_OFF;
-    assert(xQueueSendToBack(queue_, &command, portMAX_DELAY) == pdTRUE);
+    postModuleAction(id, on ? QCMD_LED_ON : QCMD_LED_OFF);
 }
 
 void SplitflapTask::setSensorTest(bool sensor_test) {
-    Command command = {};
-    command.command_type = sensor_test ? CommandType::SENSOR_TEST_SET : CommandType::SENSOR_TEST_CLEAR;
-    assert(xQueueSendToBack(queue_, &command, portMAX_DELAY) == pdTRUE);
+    beginCommand(sensor_test ? CommandType::SENSOR_TEST_SET : CommandType::SENSOR_TEST_CLEAR, SubmitPolicy::WAIT);
+    submitCommand();
 }
 
 SplitflapState SplitflapTask::getState() {
-    SemaphoreGuard lock(state_semaphore_);
-    return state_cache_;
+    SplitflapState state;
+    state_.read(state);
+    return state;
+}
+
+LoopStats SplitflapTask::getLoopStats() {
+    LoopStats stats = {};
+    loop_stats_.read(stats);
+    return stats;
+}
+
+bool SplitflapTask::getStateIfChanged(uint32_t& generation, SplitflapState& state) {
+    if (state_.generation() == generation) {
+        return false;
+    }
+    generation = state_.read(state);
+    return true;
 }
 
 void SplitflapTask::increaseOffsetTenth(const uint8_t id) {
-    Command command = {};
-    command.command_type = CommandType::MODULES;
-    command.data.module_command[id] = QCMD_INCR_OFFSET_TENTH;
-    assert(xQueueSendToBack(queue_, &command, portMAX_DELAY) == pdTRUE);
+    postModuleAction(id, QCMD_INCR_OFFSET_TENTH);
 }
 
 void SplitflapTask::increaseOffsetHalf(const uint8_t id) {
-    Command command = {};
-    command.command_type = CommandType::MODULES;
-    command.data.module_command[id] = QCMD_INCR_OFFSET_HALF;
-    assert(xQueueSendToBack(queue_, &command, portMAX_DELAY) == pdTRUE);
+    postModuleAction(id, QCMD_INCR_OFFSET_HALF);
 }
 
 void SplitflapTask::setOffset(const uint8_t id) {
-    Command command = {};
-    command.command_type = CommandType::MODULES;
-    command.data.module_command[id] = QCMD_SET_OFFSET;
-    assert(xQueueSendToBack(queue_, &command, portMAX_DELAY) == pdTRUE);
+    postModuleAction(id, QCMD_SET_OFFSET);
 }
 
 void SplitflapTask::setConfiguration(Configuration* configuration) {
@@ -456,21 +892,115 @@ void SplitflapTask::setLogger(Logger* logger) {
     logger_ = logger;
 }
 
-void SplitflapTask::postRawCommand(Command command) {
-    assert(xQueueSendToBack(queue_, &command, portMAX_DELAY) == pdTRUE);
+CommandProducer& SplitflapTask::producerForCurrentTask() {
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    for (uint8_t i = 0; i < MAX_COMMAND_PRODUCERS; i++) {
+        if (producers_[i].owner.load(std::memory_order_acquire) == task) {
+            return producers_[i];
+        }
+    }
+
+    // First command from this task; claim an unused ring
+    for (uint8_t i = 0; i < MAX_COMMAND_PRODUCERS; i++) {
+        TaskHandle_t expected = nullptr;
+        if (producers_[i].owner.compare_exchange_strong(expected, task, std::memory_order_acq_rel)) {
+            return producers_[i];
+        }
+    }
+    assert(false && "Too many tasks submitting commands; increase MAX_COMMAND_PRODUCERS");
+    return producers_[0];
+}
+
+Command* SplitflapTask::beginCommand(CommandType command_type, SubmitPolicy policy) {
+    CommandProducer& producer = producerForCurrentTask();
+
+    Command* command = producer.ring.reserve();
+    while (command == nullptr && policy == SubmitPolicy::WAIT) {
+        delay(1);
+        command = producer.ring.reserve();
+    }
+
+    if (command != nullptr) {
+        command->command_type = command_type;
+        command->mergeable = false;
+        if (command_type == CommandType::MODULES) {
+            memset(command->data.module_command, QCMD_NO_OP, sizeof(command->data.module_command));
+        } else if (command_type == CommandType::MODULE_ACTIONS) {
+            command->data.module_actions.count = 0;
+        }
+        producer.pending = command;
+        return command;
+    }
+
+    if (policy == SubmitPolicy::MERGE) {
+        command = producer.ring.reclaimNewest();
+        if (command != nullptr) {
+            if (command->mergeable && command->command_type == command_type) {
+                producer.pending = command;
+                return command;
+            }
+            // Not mergeable; hand it back untouched
+            producer.ring.publish();
+        }
+    }
+
+    producer.dropped_commands++;
+    return nullptr;
+}
+
+void SplitflapTask::submitCommand(bool mergeable) {
+    CommandProducer& producer = producerForCurrentTask();
+    if (producer.pending == nullptr) {
+        return;
+    }
+    producer.pending->mergeable = mergeable;
+    if (++producer.submitted == 0) {
+        producer.submitted++;
+    }
+    producer.pending->sequence = producer.submitted;
+    producer.pending = nullptr;
+    producer.ring.publish();
+    xTaskNotifyGive(planner_.getHandle());
+}
+
+uint32_t SplitflapTask::lastSubmittedCommand() {
+    return producerForCurrentTask().submitted;
+}
+
+AppliedCommand SplitflapTask::getLastAppliedCommand() {
+    AppliedCommand applied = {};
+    CommandProducer& producer = producerForCurrentTask();
+    if (producer.applied.generation() != 0) {
+        producer.applied.read(applied);
+    }
+    return applied;
+}
+
+void SplitflapTask::postModuleAction(uint8_t id, uint8_t action) {
+    Command* command = beginCommand(CommandType::MODULE_ACTIONS, SubmitPolicy::WAIT);
+    command->data.module_actions.count = 1;
+    command->data.module_actions.actions[0] = {id, action};
+    submitCommand();
 }
 
 void SplitflapTask::saveAllOffsets() {
-    Command command = {};
-    command.command_type = CommandType::SAVE_ALL_OFFSETS;
-    assert(xQueueSendToBack(queue_, &command, portMAX_DELAY) == pdTRUE);
+    beginCommand(CommandType::SAVE_ALL_OFFSETS, SubmitPolicy::WAIT);
+    submitCommand();
 }
 
 void SplitflapTask::restoreAllOffsets(uint16_t offsets[NUM_MODULES]) {
-    Command command = {};
-    command.command_type = CommandType::RESTORE_ALL_OFFSETS;
+    Command* command = beginCommand(CommandType::RESTORE_ALL_OFFSETS, SubmitPolicy::WAIT);
     for (uint8_t i = 0; i < NUM_MODULES; i++) {
-        command.data.module_offsets[i] = offsets[i];
+        command->data.module_offsets[i] = offsets[i];
     }
-    assert(xQueueSendToBack(queue_, &command, portMAX_DELAY) == pdTRUE);
+    submitCommand();
+}
+
+SplitflapPlannerTask::SplitflapPlannerTask(SplitflapTask& splitflap_task, const uint8_t task_core) :
+        Task("SplitflapPlan", 4096, 1, task_core),
+        splitflap_task_(splitflap_task) {
+}
+
+void SplitflapPlannerTask::run() {
+    splitflap_task_.runPlanner();
 }
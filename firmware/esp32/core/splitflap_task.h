@@ -15,11 +15,15 @@
 */
 #pragma once
 
+#include <atomic>
+
 #include "config.h"
 #include "logger.h"
 #include "splitflap_module_data.h"
 #include "configuration.h"
 
+#include "command_ring.h"
+#include "seqlock.h"
 #include "task.h"
 
 enum class SplitflapMode {
@@ -51,6 +55,9 @@ struct SplitflapModuleState {
 
 struct SplitflapState {
     SplitflapMode mode;
+
+    // Number of connected modules; only the first num_modules entries of modules are meaningful
+    uint8_t num_modules;
     SplitflapModuleState modules[NUM_MODULES];
 
 #ifdef CHAINLINK
@@ -65,6 +72,7 @@ struct SplitflapState {
         }
 
         return mode == other.mode
+            && num_modules == other.num_modules
 #ifdef CHAINLINK
             && loopbacks_ok == other.loopbacks_ok
 #endif
@@ -76,13 +84,33 @@ struct SplitflapState {
     }
 };
 
+// Motion loop performance over the last LOOP_STATS_WINDOW_MILLIS
+struct LoopStats {
+    uint32_t iterations_per_second;
+    uint32_t max_iteration_micros;
+    // Most commands drained from the queues in a single planner pass
+    uint32_t command_queue_high_water;
+    // Share of iterations in which at least one module was due for a step
+    uint32_t step_iteration_permille;
+    // Fixed-tick mode only: timer ticks missed because the previous tick overran
+    uint32_t tick_overruns;
+};
+
+#define LOOP_STATS_WINDOW_MILLIS 1000
+
+// Hardware timer driving the motion loop when MOTION_FIXED_TICK is enabled
+#define MOTION_TICK_TIMER 3
+
 enum class LedMode {
     AUTO,
     MANUAL,
 };
 
 enum class CommandType {
+    // Dense: one action per module, for full-frame updates
     MODULES,
+    // Sparse: a short list of (module, action) pairs, for operations touching only a few modules
+    MODULE_ACTIONS,
     SENSOR_TEST_SET,
     SENSOR_TEST_CLEAR,
     CONFIG,
@@ -100,10 +128,31 @@ struct ModuleConfigs {
     ModuleConfig config[NUM_MODULES];
 };
 
+#define MAX_SPARSE_MODULE_ACTIONS 8
+
+struct ModuleAction {
+    uint8_t module;
+    uint8_t action;
+};
+
+struct ModuleActions {
+    uint8_t count;
+    ModuleAction actions[MAX_SPARSE_MODULE_ACTIONS];
+};
+
 struct Command {
     CommandType command_type;
+
+    // Whether a newer command of the same type may be merged into this one while it is still pending (only true for
+    // pure flap targets, which are superseded by newer targets)
+    bool mergeable;
+
+    // Per-producer submission sequence number, set by submitCommand()
+    uint32_t sequence;
+
     union CommandData {
         uint8_t module_command[NUM_MODULES];
+        ModuleActions module_actions;
         ModuleConfigs module_configs;
         uint16_t module_offsets[NUM_MODULES];
     };
@@ -118,17 +167,153 @@ struct Command {
 #define QCMD_INCR_OFFSET_TENTH  5
 #define QCMD_INCR_OFFSET_HALF   6
 #define QCMD_SET_OFFSET         7
+#define QCMD_RECALIBRATE        8   // Reset error counters and find home, keeping the current target
 #define QCMD_FLAP               99
 
+// Commands are queued in a separate lock-free ring per submitting task, so producers never contend with each other
+#define MAX_COMMAND_PRODUCERS   6
+#define COMMAND_RING_DEPTH      4
+
+enum class SubmitPolicy {
+    // Drop the command if the submitting task's ring is full
+    DROP,
+    // If the ring is full, merge into the task's newest pending command when possible, otherwise drop
+    MERGE,
+    // Wait for space if the ring is full. Only for infrequent commands that must not be lost.
+    WAIT,
+};
+
+// Latest of a producer's commands that the executor has applied
+struct AppliedCommand {
+    uint32_t sequence;
+    uint32_t applied_micros;
+};
+
+struct CommandProducer {
+    std::atomic<TaskHandle_t> owner {nullptr};
+    CommandRing<Command, COMMAND_RING_DEPTH> ring;
+
+    // Written only by the owning task
+    Command* pending = nullptr;
+    uint32_t dropped_commands = 0;
+    uint32_t submitted = 0;
+
+    // Written only by the executor
+    Seqlock<AppliedCommand> applied;
+};
+
+// Planner output, applied by the executor as a unit. Module actions are applied in module order.
+enum class PlanType {
+    MODULE_ACTIONS,
+    SENSOR_TEST_SET,
+    SENSOR_TEST_CLEAR,
+    SAVE_ALL_OFFSETS,
+    RESTORE_ALL_OFFSETS,
+};
+
+struct MotionPlan {
+    PlanType plan_type;
+
+    // Latest command sequence number from each producer that this plan completes (0 if none)
+    uint32_t command_sequences[MAX_COMMAND_PRODUCERS];
+
+    union PlanData {
+        uint8_t actions[NUM_MODULES];
+        uint16_t module_offsets[NUM_MODULES];
+    };
+    PlanData data;
+};
+
+#define PLAN_RING_DEPTH         4
+
+// How often the executor hands a snapshot of the module state to the planner
+#define STATE_SNAPSHOT_INTERVAL_MICROS 2000
+
+#define MODULE_MASK_WORDS ((NUM_MODULES + 31) / 32)
+
+// One bit per module
+struct ModuleMask {
+    uint32_t words[MODULE_MASK_WORDS];
+
+    bool test(uint8_t module) const {
+        return words[module / 32] & (1u << (module % 32));
+    }
+
+    void set(uint8_t module) {
+        words[module / 32] |= 1u << (module % 32);
+    }
+
+    void setAll() {
+        memset(words, 0xFF, sizeof(words));
+    }
+};
+
+#define MAX_STATE_LISTENERS 4
+
+struct StateListener {
+    std::atomic<TaskHandle_t> task {nullptr};
+
+    // Changes accumulated since the listening task last took them
+    std::atomic<uint32_t> changed_modules[MODULE_MASK_WORDS];
+    std::atomic<uint32_t> other_changed {0};
+};
+
+class SplitflapTask;
+
+// Runs the planner half of a SplitflapTask (see SplitflapTask::runPlanner())
+class SplitflapPlannerTask : public Task<SplitflapPlannerTask> {
+    friend class Task<SplitflapPlannerTask>; // Allow base Task to invoke protected run()
+
+    public:
+        SplitflapPlannerTask(SplitflapTask& splitflap_task, const uint8_t task_core);
+
+    protected:
+        void run();
+
+    private:
+        SplitflapTask& splitflap_task_;
+};
+
+/**
+ * Drives the modules, split across two tasks. The executor (this task, normally pinned to core 1) only applies
+ * plans, steps the modules, does I/O and runs the loopback checks. The planner (normally on core 0, alongside the
+ * tasks submitting commands) decodes and coalesces commands into plans, which it hands to the executor over a
+ * lock-free ring, and turns the executor's raw state snapshots into published state.
+ */
 class SplitflapTask : public Task<SplitflapTask> {
     friend class Task<SplitflapTask>; // Allow base Task to invoke protected run()
+    friend class SplitflapPlannerTask;
 
     public:
-        SplitflapTask(const uint8_t task_core, const LedMode led_mode);
+        SplitflapTask(const uint8_t task_core, const LedMode led_mode, const uint8_t planner_core = 0);
         ~SplitflapTask();
+
+        // Starts both the executor and the planner
+        void begin();
         
         SplitflapState getState();
 
+        /**
+         * Copies the latest state into `state` only if it has changed since `generation` (as returned by a previous
+         * call, or 0 initially), updating `generation`. Returns whether a new state was copied.
+         */
+        bool getStateIfChanged(uint32_t& generation, SplitflapState& state);
+
+        /**
+         * Registers the calling task to be woken (via its task notification) whenever the state changes. Must be
+         * called before the calling task uses waitForStateChange().
+         */
+        void addStateListener();
+
+        /**
+         * Blocks the calling (registered) task until the state changes, its task notification is otherwise given,
+         * or the timeout elapses. Returns whether the state changed since the last call; `changed_modules` is set to
+         * the modules whose state changed in that time.
+         */
+        bool waitForStateChange(TickType_t timeout, ModuleMask& changed_modules);
+
+        LoopStats getLoopStats();
+
         void showString(const char *str, uint8_t length, bool force_full_rotation = FORCE_FULL_ROTATION, bool default_unspecified_home = false);
         void resetAll();
         void disableAll();
@@ -142,7 +327,26 @@ class SplitflapTask : public Task<SplitflapTask> {
         void restoreAllOffsets(uint16_t offsets[NUM_MODULES]);
 
         void setLogger(Logger* logger);
-        void postRawCommand(Command command);
+
+        /**
+         * Low-level in-place command submission: fill in the returned command's data (if not nullptr) and then call
+         * submitCommand() from the same task. When the command was merged into a pending one (MERGE policy), the
+         * returned command still holds the pending data, so only the entries being changed should be written.
+         */
+        Command* beginCommand(CommandType command_type, SubmitPolicy policy);
+        void submitCommand(bool mergeable = false);
+
+        /**
+         * Sequence number of the calling task's most recently submitted command (0 if none yet). Sequence numbers
+         * count up per submitting task and wrap around, skipping 0.
+         */
+        uint32_t lastSubmittedCommand();
+
+        /**
+         * Latest of the calling task's commands that the motion loop has applied (sequence 0 if none yet). Commands
+         * are applied in order, so every earlier command from the task has been applied too.
+         */
+        AppliedCommand getLastAppliedCommand();
 
         void setConfiguration(Configuration* configuration);
 
@@ -151,20 +355,63 @@ class SplitflapTask : public Task<SplitflapTask> {
 
     private:
         const LedMode led_mode_;
-        const SemaphoreHandle_t state_semaphore_;
         const SemaphoreHandle_t configuration_semaphore_;
-        QueueHandle_t queue_;
-        Command queue_receive_buffer_ = {};
+        CommandProducer producers_[MAX_COMMAND_PRODUCERS];
+
+        // Priority lane for disableAll(), checked before any queued commands each iteration
+        std::atomic<uint32_t> disable_requested_ {0};
         Logger* logger_;
         
         // Protected by configuration_semaphore_
         Configuration* configuration_;
 
+        SplitflapPlannerTask planner_;
+        CommandRing<MotionPlan, PLAN_RING_DEPTH> plans_;
+
+        // Handed from the executor to the planner, which passes them on to the configuration task to be saved
+        uint16_t offsets_to_save_[NUM_MODULES];
+        std::atomic<uint32_t> offsets_to_save_ready_ {0};
+
+        // Save handed to the configuration task that hasn't been reported on yet (0 if none)
+        uint32_t pending_save_id_ = 0;
+
+        // ---- Owned by the planner ----
+
+        ModuleConfigs current_configs_ = {};
+
+        // Plan being built (a slot in plans_), or nullptr
+        MotionPlan* plan_ = nullptr;
+
+        // Latest flap target planned for each module, or PLANNED_TARGET_UNKNOWN
+        static const uint8_t PLANNED_TARGET_UNKNOWN = 0xFF;
+        uint8_t planned_targets_[NUM_MODULES];
+
+        std::atomic<uint32_t> commands_high_water_ {0};
+        uint32_t snapshot_generation_ = 0;
+
+        // Latest state. Published to other tasks through state_ only when it changes.
+        SplitflapState state_cache_ = {};
+        Seqlock<SplitflapState> state_;
+        StateListener state_listeners_[MAX_STATE_LISTENERS];
+
+        void runPlanner();
+        void planCommands();
+        void planCommand(const Command& command);
+        void planModuleAction(uint8_t module, uint8_t action);
+        MotionPlan& beginPlan(PlanType plan_type, bool allow_reclaim = true);
+        void flushPlan();
+        void saveOffsets();
+        void reportSaveCompletion();
+        void updateStateCache();
+        void notifyStateListeners(const ModuleMask& changed_modules, bool other_changed);
+
+        // ---- Owned by the executor ----
+
         bool all_stopped_ = true;
 
         uint32_t last_sensor_print_millis_ = 0;
         bool sensor_test_ = SENSOR_TEST;
-        ModuleConfigs current_configs_ = {};
+        bool leds_changed_ = false;
 
 #ifdef CHAINLINK
         uint8_t loopback_current_out_index_ = 0;
@@ -173,14 +420,42 @@ class SplitflapTask : public Task<SplitflapTask> {
         bool loopback_all_ok_ = false;
 #endif
 
-        // Cached state. Protected by state_semaphore_
-        SplitflapState state_cache_;
-        void updateStateCache();
-
-        void processQueue();
-        void runUpdate();
+        // Raw module state for the planner
+        Seqlock<SplitflapState> snapshot_;
+        uint32_t last_snapshot_micros_ = 0;
+        void publishSnapshot();
+
+        // Loop stats accumulated over the current window, published through loop_stats_ at the end of each window
+        uint32_t loop_stats_window_start_millis_ = 0;
+        uint32_t loop_iterations_ = 0;
+        uint32_t loop_step_iterations_ = 0;
+        uint32_t loop_max_iteration_micros_ = 0;
+        uint32_t loop_tick_overruns_ = 0;
+        Seqlock<LoopStats> loop_stats_;
+        void updateLoopStats(uint32_t iteration_micros, bool stepped);
+
+        CommandProducer& producerForCurrentTask();
+        void postModuleAction(uint8_t id, uint8_t action);
+        void handleDisableRequest();
+        void processPlans();
+        void applyPlan(const MotionPlan& plan);
+        void publishAppliedCommands(const MotionPlan& plan);
+        void applyModuleAction(uint8_t module, uint8_t action);
+        bool runUpdate();
+        bool updateModules(uint32_t now_micros);
+        void updateLoopback();
+#if MOTION_FIXED_TICK
+        void runFixedTickLoop();
+#endif
         void sensorTestUpdate();
-        void log(const char* msg);
+
+        // Logged as a structured record, so the motion loop never formats strings or allocates to log
+        template <typename... Args>
+        void log(LogFormatId format_id, Args... args) {
+            if (logger_ != nullptr) {
+                logger_->logRecord(makeLogRecord(format_id, args...));
+            }
+        }
 
         int8_t findFlapIndex(uint8_t character);
 };
@@ -15,8 +15,48 @@
 */
 #pragma once
 
+#include <atomic>
+
 #include<Arduino.h>
 
+// A full build runs 9 tasks; GeneralState.task_stats has room for this many
+#define MAX_REGISTERED_TASKS 16
+
+// Handles of the tasks started through Task::begin(), for diagnostics (see TaskStatsCollector)
+class TaskRegistry {
+    public:
+        // Tasks may be started from other tasks as well as setup() (e.g. SerialTask starts the UART event task), so
+        // slots are claimed atomically
+        static void add(TaskHandle_t handle) {
+            uint32_t index = claimedRef().fetch_add(1, std::memory_order_relaxed);
+            assert(index < MAX_REGISTERED_TASKS && "Too many tasks; increase MAX_REGISTERED_TASKS");
+            if (index < MAX_REGISTERED_TASKS) {
+                handles()[index].store(handle, std::memory_order_release);
+            }
+        }
+
+        static uint8_t count() {
+            uint32_t claimed = claimedRef().load(std::memory_order_relaxed);
+            return claimed < MAX_REGISTERED_TASKS ? claimed : MAX_REGISTERED_TASKS;
+        }
+
+        // Returns nullptr if the slot has been claimed but the task's handle isn't stored yet
+        static TaskHandle_t get(uint8_t index) {
+            return handles()[index].load(std::memory_order_acquire);
+        }
+
+    private:
+        static std::atomic<uint32_t>& claimedRef() {
+            static std::atomic<uint32_t> claimed {0};
+            return claimed;
+        }
+
+        static std::atomic<TaskHandle_t>* handles() {
+            static std::atomic<TaskHandle_t> handles[MAX_REGISTERED_TASKS] = {};
+            return handles;
+        }
+};
+
 // Static polymorphic abstract base class for a FreeRTOS task using CRTP pattern. Concrete implementations
 // should implement a run() method.
 // Inspired by https://fjrg76.wordpress.com/2018/05/23/objectifying-task-creation-in-freertos-ii/
@@ -38,6 +78,7 @@ class Task {
         void begin() {
             BaseType_t result = xTaskCreatePinnedToCore(taskFunction, name, stackDepth, this, priority, &taskHandle, coreId);
             assert("Failed to create task" && result == pdPASS);
+            TaskRegistry::add(taskHandle);
         }
 
     private:
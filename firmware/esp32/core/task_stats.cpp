@@ -0,0 +1,59 @@
+/*
+   Copyright 2024 Scott Bezek and the splitflap contributors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "task_stats.h"
+
+uint8_t TaskStatsCollector::collect(TaskStats (&stats)[MAX_REGISTERED_TASKS]) {
+    uint8_t count = TaskRegistry::count();
+
+#if configUSE_TRACE_FACILITY && configGENERATE_RUN_TIME_STATS
+    uint32_t total_run_time = 0;
+    UBaseType_t num_system_tasks = uxTaskGetSystemState(system_state_, MAX_SYSTEM_TASKS, &total_run_time);
+    // A zero total means the system had more tasks than system_state_ can hold, so nothing was sampled
+    uint32_t elapsed_run_time = 0;
+    if (total_run_time != 0) {
+        elapsed_run_time = total_run_time - last_total_run_time_;
+        last_total_run_time_ = total_run_time;
+    }
+#endif
+
+    uint8_t num_stats = 0;
+    for (uint8_t i = 0; i < count; i++) {
+        TaskHandle_t handle = TaskRegistry::get(i);
+        if (handle == nullptr) {
+            // Still being registered
+            continue;
+        }
+        TaskStats& task_stats = stats[num_stats++];
+
+        strlcpy(task_stats.name, pcTaskGetTaskName(handle), sizeof(task_stats.name));
+
+        // ESP-IDF reports the high water mark in bytes rather than words
+        task_stats.stack_high_water_bytes = uxTaskGetStackHighWaterMark(handle);
+
+        task_stats.cpu_permille = 0;
+#if configUSE_TRACE_FACILITY && configGENERATE_RUN_TIME_STATS
+        for (UBaseType_t j = 0; j < num_system_tasks && elapsed_run_time > 0; j++) {
+            if (system_state_[j].xHandle == handle) {
+                uint32_t run_time = system_state_[j].ulRunTimeCounter;
+                task_stats.cpu_permille = (uint64_t)(run_time - last_run_time_[i]) * 1000 / elapsed_run_time;
+                last_run_time_[i] = run_time;
+                break;
+            }
+        }
+#endif
+    }
+    return num_stats;
+}
@@ -0,0 +1,50 @@
+/*
+   Copyright 2024 Scott Bezek and the splitflap contributors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#pragma once
+
+#include <Arduino.h>
+
+#include "task.h"
+
+struct TaskStats {
+    char name[16];
+
+    // Share of one core used since the previous sample, or 0 if the FreeRTOS build doesn't collect run time stats
+    uint16_t cpu_permille;
+    uint32_t stack_high_water_bytes;
+};
+
+/**
+ * Samples CPU usage and stack headroom of the tasks in the TaskRegistry. CPU usage is measured between consecutive
+ * calls to collect(), so a single collector should be sampled periodically from one task.
+ */
+class TaskStatsCollector {
+    public:
+        TaskStatsCollector() {}
+        TaskStatsCollector(TaskStatsCollector const&)=delete;
+        TaskStatsCollector& operator=(TaskStatsCollector const&)=delete;
+
+        /** Fills in stats for each registered task and returns how many were filled in. */
+        uint8_t collect(TaskStats (&stats)[MAX_REGISTERED_TASKS]);
+
+    private:
+#if configUSE_TRACE_FACILITY && configGENERATE_RUN_TIME_STATS
+        static const uint8_t MAX_SYSTEM_TASKS = 24;
+        TaskStatus_t system_state_[MAX_SYSTEM_TASKS];
+        uint32_t last_total_run_time_ = 0;
+        uint32_t last_run_time_[MAX_REGISTERED_TASKS] = {};
+#endif
+};
@@ -19,10 +19,28 @@
 #include "config.h"
 #include "uart_stream.h"
 
-UartStream::UartStream() : Stream() {
+UartEventTask::UartEventTask(const uint8_t task_core) : Task("UartEvents", 2048, 2, task_core) {}
+
+void UartEventTask::setEventQueue(QueueHandle_t event_queue, TaskHandle_t notify_task) {
+    event_queue_ = event_queue;
+    notify_task_ = notify_task;
+}
+
+void UartEventTask::run() {
+    uart_event_t event;
+    while (1) {
+        if (xQueueReceive(event_queue_, &event, portMAX_DELAY) == pdTRUE) {
+            // The consumer reads whatever is buffered, so the event type doesn't matter; on overflow the driver
+            // resumes receiving once the consumer has freed up space
+            xTaskNotifyGive(notify_task_);
+        }
+    }
 }
 
-void UartStream::begin() {
+UartStream::UartStream(const uint8_t task_core) : Stream(), event_task_(task_core) {
+}
+
+void UartStream::begin(TaskHandle_t rx_notify_task) {
     uart_config_t conf;
     conf.baud_rate           = MONITOR_SPEED;
     conf.data_bits           = UART_DATA_8_BITS;
@@ -32,23 +50,53 @@ void UartStream::begin() {
     conf.rx_flow_ctrl_thresh = 0;
     conf.use_ref_tick        = false;
     assert(uart_param_config(uart_port_, &conf) == ESP_OK);
-    assert(uart_driver_install(uart_port_, 32000, 32000, 0, NULL, 0) == ESP_OK);
+    if (rx_notify_task == NULL) {
+        assert(uart_driver_install(uart_port_, 32000, 32000, 0, NULL, 0) == ESP_OK);
+        return;
+    }
+    assert(uart_driver_install(uart_port_, 32000, 32000, 20, &event_queue_, 0) == ESP_OK);
+    event_task_.setEventQueue(event_queue_, rx_notify_task);
+    event_task_.begin();
+}
+
+bool UartStream::fillRxBuffer() {
+    // Takes everything that's buffered (up to the chunk size) in a single driver call
+    int read = uart_read_bytes(uart_port_, rx_buffer_, sizeof(rx_buffer_), 0);
+    rx_pos_ = 0;
+    rx_len_ = read > 0 ? read : 0;
+    return rx_len_ > 0;
+}
+
+void UartStream::setBaudRate(uint32_t baud_rate) {
+    uart_wait_tx_done(uart_port_, portMAX_DELAY);
+    assert(uart_set_baudrate(uart_port_, baud_rate) == ESP_OK);
+}
+
+uint32_t UartStream::getBaudRate() {
+    uint32_t baud_rate = 0;
+    assert(uart_get_baudrate(uart_port_, &baud_rate) == ESP_OK);
+    return baud_rate;
 }
 
 int UartStream::peek() {
-    return -1;
+    if (rx_pos_ == rx_len_ && !fillRxBuffer()) {
+        return -1;
+    }
+    return rx_buffer_[rx_pos_];
 }
 
 int UartStream::available() {
-    size_t size = 0;
-    assert(uart_get_buffered_data_len(uart_port_, &size) == ESP_OK);
-    return size;
+    if (rx_pos_ == rx_len_) {
+        fillRxBuffer();
+    }
+    return rx_len_ - rx_pos_;
 }
 
 int UartStream::read() {
-    uint8_t b;
-    int res = uart_read_bytes(uart_port_, &b, 1, 0);
-    return res != 1 ? -1 : b;
+    if (rx_pos_ == rx_len_ && !fillRxBuffer()) {
+        return -1;
+    }
+    return rx_buffer_[rx_pos_++];
 }
 
 void UartStream::flush() {
@@ -19,18 +19,48 @@
 
 #include <driver/uart.h>
 
+#include "task.h"
+
+#define UART_RX_CHUNK_SIZE 256
+
+/**
+ * Forwards UART driver events to a consumer task as task notifications, so the consumer can block until data arrives
+ * (alongside anything else it waits for via task notifications) rather than polling.
+ */
+class UartEventTask : public Task<UartEventTask> {
+    friend class Task<UartEventTask>; // Allow base Task to invoke protected run()
+
+    public:
+        UartEventTask(const uint8_t task_core);
+
+        void setEventQueue(QueueHandle_t event_queue, TaskHandle_t notify_task);
+
+    protected:
+        void run();
+
+    private:
+        QueueHandle_t event_queue_;
+        TaskHandle_t notify_task_;
+};
+
 /**
  * Implementation of an Arduino Stream for UART serial communications using the esp uart driver
  * directly, rather than the Arduino HAL which has a small fixed underlying rx FIFO size and
  * potentially other issues that cause dropped bytes at high speeds/bursts.
  * 
- * This is not a full or optimized implementation; just the minimal necessary for this project.
+ * This is not a full implementation; just the minimal necessary for this project. Received bytes are pulled from the
+ * driver in bulk into a local buffer, so per-byte reads don't each go through the driver.
  */
 class UartStream : public Stream {
     public:
-        UartStream();
+        UartStream(const uint8_t task_core);
 
-        void begin();
+        /** Installs the driver. If rx_notify_task is set, it gets a task notification whenever data arrives. */
+        void begin(TaskHandle_t rx_notify_task = NULL);
+
+        /** Waits for pending output to be sent, then switches to a new baud rate. */
+        void setBaudRate(uint32_t baud_rate);
+        uint32_t getBaudRate();
 
         // Stream methods
         int available() override;
@@ -44,4 +74,13 @@ class UartStream : public Stream {
 
     private:
         const uart_port_t uart_port_ = UART_NUM_0;
+
+        UartEventTask event_task_;
+        QueueHandle_t event_queue_;
+
+        uint8_t rx_buffer_[UART_RX_CHUNK_SIZE];
+        size_t rx_pos_ = 0;
+        size_t rx_len_ = 0;
+
+        bool fillRxBuffer();
 };
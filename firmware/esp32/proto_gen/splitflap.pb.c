@@ -12,9 +12,21 @@ PB_BIND(PB_SplitflapState, PB_SplitflapState, 4)
 PB_BIND(PB_SplitflapState_ModuleState, PB_SplitflapState_ModuleState, AUTO)
 
 
+PB_BIND(PB_SplitflapStateDelta, PB_SplitflapStateDelta, 2)
+
+
+PB_BIND(PB_SplitflapStateDelta_ModuleDelta, PB_SplitflapStateDelta_ModuleDelta, AUTO)
+
+
 PB_BIND(PB_Log, PB_Log, 2)
 
 
+PB_BIND(PB_LogRecords_Record, PB_LogRecords_Record, AUTO)
+
+
+PB_BIND(PB_LogRecords, PB_LogRecords, 2)
+
+
 PB_BIND(PB_Ack, PB_Ack, AUTO)
 
 
@@ -27,12 +39,24 @@ PB_BIND(PB_SupervisorState_PowerChannelState, PB_SupervisorState_PowerChannelSta
 PB_BIND(PB_SupervisorState_FaultInfo, PB_SupervisorState_FaultInfo, 2)
 
 
-PB_BIND(PB_GeneralState, PB_GeneralState, AUTO)
+PB_BIND(PB_GeneralState, PB_GeneralState, 2)
 
 
 PB_BIND(PB_GeneralState_BuildInfo, PB_GeneralState_BuildInfo, AUTO)
 
 
+PB_BIND(PB_GeneralState_LoopStats, PB_GeneralState_LoopStats, AUTO)
+
+
+PB_BIND(PB_GeneralState_TaskStats, PB_GeneralState_TaskStats, AUTO)
+
+
+PB_BIND(PB_BaudRateChange, PB_BaudRateChange, AUTO)
+
+
+PB_BIND(PB_CommandApplied, PB_CommandApplied, AUTO)
+
+
 PB_BIND(PB_FromSplitflap, PB_FromSplitflap, 4)
 
 
@@ -48,9 +72,24 @@ PB_BIND(PB_SplitflapConfig, PB_SplitflapConfig, 2)
 PB_BIND(PB_SplitflapConfig_ModuleConfig, PB_SplitflapConfig_ModuleConfig, AUTO)
 
 
+PB_BIND(PB_SplitflapBatch, PB_SplitflapBatch, AUTO)
+
+
+PB_BIND(PB_SplitflapBatch_Entry, PB_SplitflapBatch_Entry, 2)
+
+
 PB_BIND(PB_RequestState, PB_RequestState, AUTO)
 
 
+PB_BIND(PB_SetBaudRate, PB_SetBaudRate, AUTO)
+
+
+PB_BIND(PB_Subscribe, PB_Subscribe, AUTO)
+
+
+PB_BIND(PB_Ping, PB_Ping, AUTO)
+
+
 PB_BIND(PB_ToSplitflap, PB_ToSplitflap, 2)
 
 
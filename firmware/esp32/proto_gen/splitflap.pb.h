@@ -48,24 +48,79 @@ typedef enum _PB_SplitflapCommand_ModuleCommand_Action {
 
 /* Struct definitions */
 typedef struct _PB_RequestState { 
-    char dummy_field;
+    bool enable_state_deltas; /* * Send SplitflapStateDelta messages between full SplitflapState keyframes from now on. Older hosts leave this unset and only get full states. */
+    bool packed_module_state; /* * Report module states in the compact packed_modules fields of SplitflapState/SplitflapStateDelta instead of as ModuleState messages */
+    bool structured_logs; /* * Send messages logged with a format ID as LogRecords instead of formatting them into Log text */
 } PB_RequestState;
 
+/* * Several commands and configs in a single frame (and a single ack), applied in order. Each entry can be delayed
+ relative to the previous one, so hosts can send a short sequence ahead of time. Commands, configs and batches sent
+ after a batch are only acked and applied once all of its entries have been applied. */
+typedef struct _PB_SplitflapBatch { 
+    char dummy_field;
+} PB_SplitflapBatch;
+
 /* * Chainlink Base state -- only reported by Chainlink Base firmware, NOT standard Chainlink firmware */
 typedef struct _PB_Ack { 
     uint32_t nonce; 
+    uint32_t next_expected_nonce; /* * Only for windowed ToSplitflap messages: every nonce before this one has been received and applied, in order */
+    uint32_t received_micros; /* * Device clock (micros, wraps) when the acked message was received */
 } PB_Ack;
 
+/* * Response to SetBaudRate, sent at the current baud rate. If accepted, the device switches to the new rate right
+ after sending this, and falls back to the previous rate unless it receives a valid message at the new rate within
+ a few seconds. */
+typedef struct _PB_BaudRateChange { 
+    uint32_t baud_rate; 
+    bool accepted; 
+} PB_BaudRateChange;
+
+/* * Sent once the motion loop has applied the command or config from the ToSplitflap message with this nonce, if
+ subscribed to via Subscribe.command_timing. Both times are from the device clock (micros, wraps), so
+ applied_micros - received_micros is the on-device processing latency. */
+typedef struct _PB_CommandApplied { 
+    uint32_t nonce; 
+    uint32_t received_micros; 
+    uint32_t applied_micros; 
+} PB_CommandApplied;
+
 typedef struct _PB_GeneralState_BuildInfo { 
     char git_hash[91]; 
     char build_date[13]; 
     char build_os[13]; 
 } PB_GeneralState_BuildInfo;
 
+typedef struct _PB_GeneralState_LoopStats { 
+    uint32_t iterations_per_second; 
+    uint32_t max_iteration_micros; 
+    uint32_t command_queue_high_water; /* * Most commands drained from the command queues in a single iteration */
+    uint32_t step_iteration_permille; /* * Fraction of iterations in which at least one module was due to step, in thousandths */
+    uint32_t tick_overruns; /* * Fixed-tick motion loop only: timer ticks missed because the previous tick's work overran */
+} PB_GeneralState_LoopStats;
+
+typedef struct _PB_GeneralState_TaskStats { 
+    char name[16]; 
+    uint32_t cpu_permille; /* * CPU time used since the previous report, in thousandths of one core. Always 0 if the firmware was built without FreeRTOS run time stats. */
+    uint32_t stack_high_water_bytes; 
+} PB_GeneralState_TaskStats;
+
 typedef struct _PB_Log { 
     char msg[256]; 
 } PB_Log;
 
+typedef struct _PB_LogRecords_Record { 
+    uint32_t timestamp_millis; /* * Device millis() when the message was logged */
+    uint16_t format_id; /* * ID of the message in firmware/esp32/core/log_formats.h (see software/chainlink/proto_gen/log_formats.json) */
+    pb_size_t args_count;
+    uint32_t args[4]; /* * Integer arguments as 32-bit values (sign-extended for %d); float arguments as their IEEE 754 bit pattern */
+} PB_LogRecords_Record;
+
+/* * Structured log messages, only sent to hosts that asked for them with RequestState.structured_logs */
+typedef struct _PB_LogRecords { 
+    pb_size_t records_count;
+    PB_LogRecords_Record records[16]; 
+} PB_LogRecords;
+
 typedef struct _PB_PersistentConfiguration { 
     uint32_t version; 
     uint32_t num_flaps; 
@@ -73,6 +128,32 @@ typedef struct _PB_PersistentConfiguration {
     uint16_t module_offset_steps[255]; 
 } PB_PersistentConfiguration;
 
+/* * Proposes a new serial baud rate. The device replies with a BaudRateChange before switching. */
+typedef struct _PB_SetBaudRate { 
+    uint32_t baud_rate; 
+} PB_SetBaudRate;
+
+typedef PB_BYTES_ARRAY_T(32) PB_Subscribe_modules_t;
+/* * Chooses which messages the device sends unprompted, and how often. Each Subscribe replaces the previous one; until a
+ host sends one, everything is sent at the default rates. Acks and replies to RequestState are always sent. */
+typedef struct _PB_Subscribe { 
+    bool splitflap_state; 
+    bool general_state; 
+    bool supervisor_state; 
+    bool logs; 
+    uint32_t min_state_interval_millis; /* * Minimum time between state messages sent for changes (0 for the default: 20ms with deltas, 100ms without) */
+    uint32_t max_state_interval_millis; /* * Maximum time between full SplitflapState keyframes, sent even if nothing changed (0 for the default 5s) */
+    uint32_t general_state_interval_millis; /* * Time between GeneralState messages (0 for the default 2s) */
+    PB_Subscribe_modules_t modules; /* * Only changes to these modules cause state messages or are included in deltas: bit (i % 8) of byte (i / 8) is set
+ for module i. Empty for all modules. Full SplitflapState keyframes still include every module. */
+    bool command_timing; /* * Send CommandApplied for each command and config once it has been applied (off by default) */
+} PB_Subscribe;
+
+/* * Does nothing but get acked, for measuring round trip time */
+typedef struct _PB_Ping { 
+    char dummy_field;
+} PB_Ping;
+
 typedef struct _PB_SplitflapCommand_ModuleCommand { 
     PB_SplitflapCommand_ModuleCommand_Action action; 
     uint8_t param; 
@@ -112,6 +193,10 @@ typedef struct _PB_GeneralState {
     bool has_build_info;
     PB_GeneralState_BuildInfo build_info; 
     PB_GeneralState_flap_character_set_t flap_character_set; 
+    bool has_loop_stats;
+    PB_GeneralState_LoopStats loop_stats; /* * Motion loop performance over the last reporting period (~1 second) */
+    pb_size_t task_stats_count;
+    PB_GeneralState_TaskStats task_stats[16]; 
 } PB_GeneralState;
 
 /* * Non-volatile on-device storage schema */
@@ -126,12 +211,39 @@ typedef struct _PB_SplitflapConfig {
     PB_SplitflapConfig_ModuleConfig modules[255]; 
 } PB_SplitflapConfig;
 
+typedef struct _PB_SplitflapBatch_Entry { 
+    uint32_t delay_millis; /* * How long to wait after the previous entry (or after the batch arrives, for the first one) */
+    pb_size_t which_payload;
+    union {
+        PB_SplitflapCommand splitflap_command;
+        PB_SplitflapConfig splitflap_config;
+    } payload; 
+} PB_SplitflapBatch_Entry;
+
+typedef PB_BYTES_ARRAY_T(1020) PB_SplitflapState_packed_modules_t;
 typedef struct _PB_SplitflapState { 
     pb_size_t modules_count;
     PB_SplitflapState_ModuleState modules[255]; 
     bool loopbacks_ok; 
+    uint32_t sequence; /* * Incremented for every SplitflapState and SplitflapStateDelta sent, so hosts can detect missed deltas */
+    PB_SplitflapState_packed_modules_t packed_modules; /* * Only if the host asked for packed_module_state in RequestState, replacing `modules`. Layout per module: byte 0 bits 0-2 state, bit 3 moving, bit 4 home_state, bit 5 counts follow; byte 1 flap_index; then count_unexpected_home, count_missed_home if bit 5 is set. */
 } PB_SplitflapState;
 
+typedef struct _PB_SplitflapStateDelta_ModuleDelta { 
+    uint8_t index; 
+    bool has_state;
+    PB_SplitflapState_ModuleState state; 
+} PB_SplitflapStateDelta_ModuleDelta;
+
+typedef PB_BYTES_ARRAY_T(160) PB_SplitflapStateDelta_packed_modules_t;
+typedef struct _PB_SplitflapStateDelta { 
+    uint32_t sequence; /* * Applies on top of the state with sequence - 1. On a gap, hosts should send a RequestState to get a full SplitflapState. */
+    pb_size_t modules_count;
+    PB_SplitflapStateDelta_ModuleDelta modules[32]; /* * Only the modules that changed */
+    bool loopbacks_ok; 
+    PB_SplitflapStateDelta_packed_modules_t packed_modules; /* * Packed equivalent of `modules`: each changed module as its index byte followed by its SplitflapState.packed_modules entry */
+} PB_SplitflapStateDelta;
+
 /* * Chainlink general state, reported infrequently -- only reported by standard Chainlink firmware, NOT Chainlink Base firmware */
 typedef struct _PB_SupervisorState { 
     uint32_t uptime_millis; 
@@ -150,6 +262,10 @@ typedef struct _PB_FromSplitflap {
         PB_Ack ack;
         PB_SupervisorState supervisor_state;
         PB_GeneralState general_state;
+        PB_SplitflapStateDelta splitflap_state_delta;
+        PB_BaudRateChange baud_rate_change;
+        PB_LogRecords log_records;
+        PB_CommandApplied command_applied;
     } payload; 
 } PB_FromSplitflap;
 
@@ -160,7 +276,15 @@ typedef struct _PB_ToSplitflap {
         PB_SplitflapCommand splitflap_command;
         PB_SplitflapConfig splitflap_config;
         PB_RequestState request_state;
+        PB_SetBaudRate set_baud_rate;
+        PB_Subscribe subscribe;
+        PB_Ping ping;
     } payload; 
+    bool windowed; /* * Set by hosts that keep several messages in flight. Windowed messages are applied strictly in nonce order: one
+ that arrives after a gap is dropped (but still acked), and the host resends from the oldest unacknowledged nonce. */
+    uint32_t window_base; /* * Oldest nonce the host hasn't had acknowledged yet (windowed messages only) */
+    uint32_t session_id; /* * Random ID the host picks when it connects (windowed messages only). A new ID restarts the window at window_base,
+ so a reconnecting host's nonces are never mistaken for retries from its previous session. */
 } PB_ToSplitflap;
 
 
@@ -187,46 +311,82 @@ extern "C" {
 #endif
 
 /* Initializer values for message structs */
-#define PB_SplitflapState_init_default           {0, {PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default}, 0}
+#define PB_SplitflapState_init_default           {0, {PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default, PB_SplitflapState_ModuleState_init_default}, 0, 0, {0, {0}}}
 #define PB_SplitflapState_ModuleState_init_default {_PB_SplitflapState_ModuleState_State_MIN, 0, 0, 0, 0, 0}
+#define PB_SplitflapStateDelta_init_default      {0, 0, {PB_SplitflapStateDelta_ModuleDelta_init_default, PB_SplitflapStateDelta_ModuleDelta_init_default, PB_SplitflapStateDelta_ModuleDelta_init_default, PB_SplitflapStateDelta_ModuleDelta_init_default, PB_SplitflapStateDelta_ModuleDelta_init_default, PB_SplitflapStateDelta_ModuleDelta_init_default, PB_SplitflapStateDelta_ModuleDelta_init_default, PB_SplitflapStateDelta_ModuleDelta_init_default, PB_SplitflapStateDelta_ModuleDelta_init_default, PB_SplitflapStateDelta_ModuleDelta_init_default, PB_SplitflapStateDelta_ModuleDelta_init_default, PB_SplitflapStateDelta_ModuleDelta_init_default, PB_SplitflapStateDelta_ModuleDelta_init_default, PB_SplitflapStateDelta_ModuleDelta_init_default, PB_SplitflapStateDelta_ModuleDelta_init_default, PB_SplitflapStateDelta_ModuleDelta_init_default, PB_SplitflapStateDelta_ModuleDelta_init_default, PB_SplitflapStateDelta_ModuleDelta_init_default, PB_SplitflapStateDelta_ModuleDelta_init_default, PB_SplitflapStateDelta_ModuleDelta_init_default, PB_SplitflapStateDelta_ModuleDelta_init_default, PB_SplitflapStateDelta_ModuleDelta_init_default, PB_SplitflapStateDelta_ModuleDelta_init_default, PB_SplitflapStateDelta_ModuleDelta_init_default, PB_SplitflapStateDelta_ModuleDelta_init_default, PB_SplitflapStateDelta_ModuleDelta_init_default, PB_SplitflapStateDelta_ModuleDelta_init_default, PB_SplitflapStateDelta_ModuleDelta_init_default, PB_SplitflapStateDelta_ModuleDelta_init_default, PB_SplitflapStateDelta_ModuleDelta_init_default, PB_SplitflapStateDelta_ModuleDelta_init_default, PB_SplitflapStateDelta_ModuleDelta_init_default}, 0, {0, {0}}}
+#define PB_SplitflapStateDelta_ModuleDelta_init_default {0, false, PB_SplitflapState_ModuleState_init_default}
 #define PB_Log_init_default                      {""}
-#define PB_Ack_init_default                      {0}
+#define PB_LogRecords_Record_init_default        {0, 0, 0, {0, 0, 0, 0}}
+#define PB_LogRecords_init_default               {0, {PB_LogRecords_Record_init_default, PB_LogRecords_Record_init_default, PB_LogRecords_Record_init_default, PB_LogRecords_Record_init_default, PB_LogRecords_Record_init_default, PB_LogRecords_Record_init_default, PB_LogRecords_Record_init_default, PB_LogRecords_Record_init_default, PB_LogRecords_Record_init_default, PB_LogRecords_Record_init_default, PB_LogRecords_Record_init_default, PB_LogRecords_Record_init_default, PB_LogRecords_Record_init_default, PB_LogRecords_Record_init_default, PB_LogRecords_Record_init_default, PB_LogRecords_Record_init_default}}
+#define PB_Ack_init_default                      {0, 0, 0}
 #define PB_SupervisorState_init_default          {0, _PB_SupervisorState_State_MIN, 0, {PB_SupervisorState_PowerChannelState_init_default, PB_SupervisorState_PowerChannelState_init_default, PB_SupervisorState_PowerChannelState_init_default, PB_SupervisorState_PowerChannelState_init_default, PB_SupervisorState_PowerChannelState_init_default}, false, PB_SupervisorState_FaultInfo_init_default}
 #define PB_SupervisorState_PowerChannelState_init_default {0, 0, 0}
 #define PB_SupervisorState_FaultInfo_init_default {_PB_SupervisorState_FaultInfo_FaultType_MIN, "", 0}
-#define PB_GeneralState_init_default             {0, 0, false, PB_GeneralState_BuildInfo_init_default, {0, {0}}}
+#define PB_GeneralState_init_default             {0, 0, false, PB_GeneralState_BuildInfo_init_default, {0, {0}}, false, PB_GeneralState_LoopStats_init_default, 0, {PB_GeneralState_TaskStats_init_default, PB_GeneralState_TaskStats_init_default, PB_GeneralState_TaskStats_init_default, PB_GeneralState_TaskStats_init_default, PB_GeneralState_TaskStats_init_default, PB_GeneralState_TaskStats_init_default, PB_GeneralState_TaskStats_init_default, PB_GeneralState_TaskStats_init_default, PB_GeneralState_TaskStats_init_default, PB_GeneralState_TaskStats_init_default, PB_GeneralState_TaskStats_init_default, PB_GeneralState_TaskStats_init_default, PB_GeneralState_TaskStats_init_default, PB_GeneralState_TaskStats_init_default, PB_GeneralState_TaskStats_init_default, PB_GeneralState_TaskStats_init_default}}
 #define PB_GeneralState_BuildInfo_init_default   {"", "", ""}
+#define PB_GeneralState_LoopStats_init_default   {0, 0, 0, 0, 0}
+#define PB_GeneralState_TaskStats_init_default   {"", 0, 0}
+#define PB_BaudRateChange_init_default           {0, 0}
+#define PB_CommandApplied_init_default           {0, 0, 0}
 #define PB_FromSplitflap_init_default            {0, {PB_SplitflapState_init_default}}
 #define PB_SplitflapCommand_init_default         {0, {PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default, PB_SplitflapCommand_ModuleCommand_init_default}, 0}
 #define PB_SplitflapCommand_ModuleCommand_init_default {_PB_SplitflapCommand_ModuleCommand_Action_MIN, 0}
 #define PB_SplitflapConfig_init_default          {0, {PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default, PB_SplitflapConfig_ModuleConfig_init_default}}
 #define PB_SplitflapConfig_ModuleConfig_init_default {0, 0, 0}
-#define PB_RequestState_init_default             {0}
-#define PB_ToSplitflap_init_default              {0, 0, {PB_SplitflapCommand_init_default}}
+#define PB_SplitflapBatch_init_default           {0}
+#define PB_SplitflapBatch_Entry_init_default     {0, 0, {PB_SplitflapCommand_init_default}}
+#define PB_RequestState_init_default             {0, 0, 0}
+#define PB_SetBaudRate_init_default              {0}
+#define PB_Subscribe_init_default                {0, 0, 0, 0, 0, 0, 0, {0, {0}}, 0}
+#define PB_Ping_init_default                     {0}
+#define PB_ToSplitflap_init_default              {0, 0, {PB_SplitflapCommand_init_default}, 0, 0, 0}
 #define PB_PersistentConfiguration_init_default  {0, 0, 0, {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}}
-#define PB_SplitflapState_init_zero              {0, {PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero}, 0}
+#define PB_SplitflapState_init_zero              {0, {PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero, PB_SplitflapState_ModuleState_init_zero}, 0, 0, {0, {0}}}
 #define PB_SplitflapState_ModuleState_init_zero  {_PB_SplitflapState_ModuleState_State_MIN, 0, 0, 0, 0, 0}
+#define PB_SplitflapStateDelta_init_zero         {0, 0, {PB_SplitflapStateDelta_ModuleDelta_init_zero, PB_SplitflapStateDelta_ModuleDelta_init_zero, PB_SplitflapStateDelta_ModuleDelta_init_zero, PB_SplitflapStateDelta_ModuleDelta_init_zero, PB_SplitflapStateDelta_ModuleDelta_init_zero, PB_SplitflapStateDelta_ModuleDelta_init_zero, PB_SplitflapStateDelta_ModuleDelta_init_zero, PB_SplitflapStateDelta_ModuleDelta_init_zero, PB_SplitflapStateDelta_ModuleDelta_init_zero, PB_SplitflapStateDelta_ModuleDelta_init_zero, PB_SplitflapStateDelta_ModuleDelta_init_zero, PB_SplitflapStateDelta_ModuleDelta_init_zero, PB_SplitflapStateDelta_ModuleDelta_init_zero, PB_SplitflapStateDelta_ModuleDelta_init_zero, PB_SplitflapStateDelta_ModuleDelta_init_zero, PB_SplitflapStateDelta_ModuleDelta_init_zero, PB_SplitflapStateDelta_ModuleDelta_init_zero, PB_SplitflapStateDelta_ModuleDelta_init_zero, PB_SplitflapStateDelta_ModuleDelta_init_zero, PB_SplitflapStateDelta_ModuleDelta_init_zero, PB_SplitflapStateDelta_ModuleDelta_init_zero, PB_SplitflapStateDelta_ModuleDelta_init_zero, PB_SplitflapStateDelta_ModuleDelta_init_zero, PB_SplitflapStateDelta_ModuleDelta_init_zero, PB_SplitflapStateDelta_ModuleDelta_init_zero, PB_SplitflapStateDelta_ModuleDelta_init_zero, PB_SplitflapStateDelta_ModuleDelta_init_zero, PB_SplitflapStateDelta_ModuleDelta_init_zero, PB_SplitflapStateDelta_ModuleDelta_init_zero, PB_SplitflapStateDelta_ModuleDelta_init_zero, PB_SplitflapStateDelta_ModuleDelta_init_zero, PB_SplitflapStateDelta_ModuleDelta_init_zero}, 0, {0, {0}}}
+#define PB_SplitflapStateDelta_ModuleDelta_init_zero {0, false, PB_SplitflapState_ModuleState_init_zero}
 #define PB_Log_init_zero                         {""}
-#define PB_Ack_init_zero                         {0}
+#define PB_LogRecords_Record_init_zero           {0, 0, 0, {0, 0, 0, 0}}
+#define PB_LogRecords_init_zero                  {0, {PB_LogRecords_Record_init_zero, PB_LogRecords_Record_init_zero, PB_LogRecords_Record_init_zero, PB_LogRecords_Record_init_zero, PB_LogRecords_Record_init_zero, PB_LogRecords_Record_init_zero, PB_LogRecords_Record_init_zero, PB_LogRecords_Record_init_zero, PB_LogRecords_Record_init_zero, PB_LogRecords_Record_init_zero, PB_LogRecords_Record_init_zero, PB_LogRecords_Record_init_zero, PB_LogRecords_Record_init_zero, PB_LogRecords_Record_init_zero, PB_LogRecords_Record_init_zero, PB_LogRecords_Record_init_zero}}
+#define PB_Ack_init_zero                         {0, 0, 0}
 #define PB_SupervisorState_init_zero             {0, _PB_SupervisorState_State_MIN, 0, {PB_SupervisorState_PowerChannelState_init_zero, PB_SupervisorState_PowerChannelState_init_zero, PB_SupervisorState_PowerChannelState_init_zero, PB_SupervisorState_PowerChannelState_init_zero, PB_SupervisorState_PowerChannelState_init_zero}, false, PB_SupervisorState_FaultInfo_init_zero}
 #define PB_SupervisorState_PowerChannelState_init_zero {0, 0, 0}
 #define PB_SupervisorState_FaultInfo_init_zero   {_PB_SupervisorState_FaultInfo_FaultType_MIN, "", 0}
-#define PB_GeneralState_init_zero                {0, 0, false, PB_GeneralState_BuildInfo_init_zero, {0, {0}}}
+#define PB_GeneralState_init_zero                {0, 0, false, PB_GeneralState_BuildInfo_init_zero, {0, {0}}, false, PB_GeneralState_LoopStats_init_zero, 0, {PB_GeneralState_TaskStats_init_zero, PB_GeneralState_TaskStats_init_zero, PB_GeneralState_TaskStats_init_zero, PB_GeneralState_TaskStats_init_zero, PB_GeneralState_TaskStats_init_zero, PB_GeneralState_TaskStats_init_zero, PB_GeneralState_TaskStats_init_zero, PB_GeneralState_TaskStats_init_zero, PB_GeneralState_TaskStats_init_zero, PB_GeneralState_TaskStats_init_zero, PB_GeneralState_TaskStats_init_zero, PB_GeneralState_TaskStats_init_zero, PB_GeneralState_TaskStats_init_zero, PB_GeneralState_TaskStats_init_zero, PB_GeneralState_TaskStats_init_zero, PB_GeneralState_TaskStats_init_zero}}
 #define PB_GeneralState_BuildInfo_init_zero      {"", "", ""}
+#define PB_GeneralState_LoopStats_init_zero      {0, 0, 0, 0, 0}
+#define PB_GeneralState_TaskStats_init_zero      {"", 0, 0}
+#define PB_BaudRateChange_init_zero              {0, 0}
+#define PB_CommandApplied_init_zero              {0, 0, 0}
 #define PB_FromSplitflap_init_zero               {0, {PB_SplitflapState_init_zero}}
 #define PB_SplitflapCommand_init_zero            {0, {PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero, PB_SplitflapCommand_ModuleCommand_init_zero}, 0}
 #define PB_SplitflapCommand_ModuleCommand_init_zero {_PB_SplitflapCommand_ModuleCommand_Action_MIN, 0}
 #define PB_SplitflapConfig_init_zero             {0, {PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero, PB_SplitflapConfig_ModuleConfig_init_zero}}
 #define PB_SplitflapConfig_ModuleConfig_init_zero {0, 0, 0}
-#define PB_RequestState_init_zero                {0}
-#define PB_ToSplitflap_init_zero                 {0, 0, {PB_SplitflapCommand_init_zero}}
+#define PB_SplitflapBatch_init_zero              {0}
+#define PB_SplitflapBatch_Entry_init_zero        {0, 0, {PB_SplitflapCommand_init_zero}}
+#define PB_RequestState_init_zero                {0, 0, 0}
+#define PB_SetBaudRate_init_zero                 {0}
+#define PB_Subscribe_init_zero                   {0, 0, 0, 0, 0, 0, 0, {0, {0}}, 0}
+#define PB_Ping_init_zero                        {0}
+#define PB_ToSplitflap_init_zero                 {0, 0, {PB_SplitflapCommand_init_zero}, 0, 0, 0}
 #define PB_PersistentConfiguration_init_zero     {0, 0, 0, {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}}
 
 /* Field tags (for use in manual encoding/decoding) */
 #define PB_Ack_nonce_tag                         1
+#define PB_Ack_next_expected_nonce_tag           2
+#define PB_Ack_received_micros_tag               3
 #define PB_GeneralState_BuildInfo_git_hash_tag   1
 #define PB_GeneralState_BuildInfo_build_date_tag 2
 #define PB_GeneralState_BuildInfo_build_os_tag   3
+#define PB_GeneralState_LoopStats_iterations_per_second_tag 1
+#define PB_GeneralState_LoopStats_max_iteration_micros_tag 2
+#define PB_GeneralState_LoopStats_command_queue_high_water_tag 3
+#define PB_GeneralState_LoopStats_step_iteration_permille_tag 4
+#define PB_GeneralState_LoopStats_tick_overruns_tag 5
+#define PB_GeneralState_TaskStats_name_tag       1
+#define PB_GeneralState_TaskStats_cpu_permille_tag 2
+#define PB_GeneralState_TaskStats_stack_high_water_bytes_tag 3
 #define PB_Log_msg_tag                           1
 #define PB_PersistentConfiguration_version_tag   1
 #define PB_PersistentConfiguration_num_flaps_tag 2
@@ -242,6 +402,8 @@ extern "C" {
 #define PB_SplitflapState_ModuleState_home_state_tag 4
 #define PB_SplitflapState_ModuleState_count_unexpected_home_tag 5
 #define PB_SplitflapState_ModuleState_count_missed_home_tag 6
+#define PB_SplitflapStateDelta_ModuleDelta_index_tag 1
+#define PB_SplitflapStateDelta_ModuleDelta_state_tag 2
 #define PB_SupervisorState_FaultInfo_type_tag    1
 #define PB_SupervisorState_FaultInfo_msg_tag     2
 #define PB_SupervisorState_FaultInfo_ts_millis_tag 3
@@ -252,11 +414,19 @@ extern "C" {
 #define PB_GeneralState_uptime_millis_tag        2
 #define PB_GeneralState_build_info_tag           3
 #define PB_GeneralState_flap_character_set_tag   4
+#define PB_GeneralState_loop_stats_tag           5
+#define PB_GeneralState_task_stats_tag           6
 #define PB_SplitflapCommand_modules_tag          2
 #define PB_SplitflapCommand_save_all_offsets_tag 3
 #define PB_SplitflapConfig_modules_tag           1
 #define PB_SplitflapState_modules_tag            1
 #define PB_SplitflapState_loopbacks_ok_tag       2
+#define PB_SplitflapState_sequence_tag           3
+#define PB_SplitflapState_packed_modules_tag     4
+#define PB_SplitflapStateDelta_sequence_tag      1
+#define PB_SplitflapStateDelta_modules_tag       2
+#define PB_SplitflapStateDelta_loopbacks_ok_tag  3
+#define PB_SplitflapStateDelta_packed_modules_tag 4
 #define PB_SupervisorState_uptime_millis_tag     1
 #define PB_SupervisorState_state_tag             2
 #define PB_SupervisorState_power_channels_tag    3
@@ -266,15 +436,52 @@ extern "C" {
 #define PB_FromSplitflap_ack_tag                 3
 #define PB_FromSplitflap_supervisor_state_tag    4
 #define PB_FromSplitflap_general_state_tag       5
+#define PB_FromSplitflap_splitflap_state_delta_tag 6
+#define PB_FromSplitflap_baud_rate_change_tag    7
+#define PB_FromSplitflap_log_records_tag         8
+#define PB_FromSplitflap_command_applied_tag     9
+#define PB_RequestState_enable_state_deltas_tag  1
+#define PB_RequestState_packed_module_state_tag  2
+#define PB_RequestState_structured_logs_tag      3
 #define PB_ToSplitflap_nonce_tag                 1
 #define PB_ToSplitflap_splitflap_command_tag     2
 #define PB_ToSplitflap_splitflap_config_tag      3
 #define PB_ToSplitflap_request_state_tag         4
+#define PB_ToSplitflap_set_baud_rate_tag         5
+#define PB_ToSplitflap_subscribe_tag             9
+#define PB_ToSplitflap_ping_tag                  10
+#define PB_ToSplitflap_windowed_tag              6
+#define PB_ToSplitflap_window_base_tag           7
+#define PB_ToSplitflap_session_id_tag            11
+#define PB_BaudRateChange_baud_rate_tag          1
+#define PB_BaudRateChange_accepted_tag           2
+#define PB_CommandApplied_nonce_tag              1
+#define PB_CommandApplied_received_micros_tag    2
+#define PB_CommandApplied_applied_micros_tag     3
+#define PB_SetBaudRate_baud_rate_tag             1
+#define PB_SplitflapBatch_Entry_delay_millis_tag 1
+#define PB_SplitflapBatch_Entry_splitflap_command_tag 2
+#define PB_SplitflapBatch_Entry_splitflap_config_tag 3
+#define PB_LogRecords_Record_timestamp_millis_tag 1
+#define PB_LogRecords_Record_format_id_tag       2
+#define PB_LogRecords_Record_args_tag            3
+#define PB_LogRecords_records_tag                1
+#define PB_Subscribe_splitflap_state_tag         1
+#define PB_Subscribe_general_state_tag           2
+#define PB_Subscribe_supervisor_state_tag        3
+#define PB_Subscribe_logs_tag                    4
+#define PB_Subscribe_min_state_interval_millis_tag 5
+#define PB_Subscribe_max_state_interval_millis_tag 6
+#define PB_Subscribe_general_state_interval_millis_tag 7
+#define PB_Subscribe_modules_tag                 8
+#define PB_Subscribe_command_timing_tag          9
 
 /* Struct field encoding specification for nanopb */
 #define PB_SplitflapState_FIELDLIST(X, a) \
 X(a, STATIC,   REPEATED, MESSAGE,  modules,           1) \
-X(a, STATIC,   SINGULAR, BOOL,     loopbacks_ok,      2)
+X(a, STATIC,   SINGULAR, BOOL,     loopbacks_ok,      2) \
+X(a, STATIC,   SINGULAR, UINT32,   sequence,          3) \
+X(a, STATIC,   SINGULAR, BYTES,    packed_modules,    4)
 #define PB_SplitflapState_CALLBACK NULL
 #define PB_SplitflapState_DEFAULT NULL
 #define PB_SplitflapState_modules_MSGTYPE PB_SplitflapState_ModuleState
@@ -289,13 +496,44 @@ X(a, STATIC,   SINGULAR, UINT32,   count_missed_home,   6)
 #define PB_SplitflapState_ModuleState_CALLBACK NULL
 #define PB_SplitflapState_ModuleState_DEFAULT NULL
 
+#define PB_SplitflapStateDelta_FIELDLIST(X, a) \
+X(a, STATIC,   SINGULAR, UINT32,   sequence,          1) \
+X(a, STATIC,   REPEATED, MESSAGE,  modules,           2) \
+X(a, STATIC,   SINGULAR, BOOL,     loopbacks_ok,      3) \
+X(a, STATIC,   SINGULAR, BYTES,    packed_modules,    4)
+#define PB_SplitflapStateDelta_CALLBACK NULL
+#define PB_SplitflapStateDelta_DEFAULT NULL
+#define PB_SplitflapStateDelta_modules_MSGTYPE PB_SplitflapStateDelta_ModuleDelta
+
+#define PB_SplitflapStateDelta_ModuleDelta_FIELDLIST(X, a) \
+X(a, STATIC,   SINGULAR, UINT32,   index,             1) \
+X(a, STATIC,   OPTIONAL, MESSAGE,  state,             2)
+#define PB_SplitflapStateDelta_ModuleDelta_CALLBACK NULL
+#define PB_SplitflapStateDelta_ModuleDelta_DEFAULT NULL
+#define PB_SplitflapStateDelta_ModuleDelta_state_MSGTYPE PB_SplitflapState_ModuleState
+
 #define PB_Log_FIELDLIST(X, a) \
 X(a, STATIC,   SINGULAR, STRING,   msg,               1)
 #define PB_Log_CALLBACK NULL
 #define PB_Log_DEFAULT NULL
 
+#define PB_LogRecords_Record_FIELDLIST(X, a) \
+X(a, STATIC,   SINGULAR, UINT32,   timestamp_millis,   1) \
+X(a, STATIC,   SINGULAR, UINT32,   format_id,         2) \
+X(a, STATIC,   REPEATED, UINT32,   args,              3)
+#define PB_LogRecords_Record_CALLBACK NULL
+#define PB_LogRecords_Record_DEFAULT NULL
+
+#define PB_LogRecords_FIELDLIST(X, a) \
+X(a, STATIC,   REPEATED, MESSAGE,  records,           1)
+#define PB_LogRecords_CALLBACK NULL
+#define PB_LogRecords_DEFAULT NULL
+#define PB_LogRecords_records_MSGTYPE PB_LogRecords_Record
+
 #define PB_Ack_FIELDLIST(X, a) \
-X(a, STATIC,   SINGULAR, UINT32,   nonce,             1)
+X(a, STATIC,   SINGULAR, UINT32,   nonce,             1) \
+X(a, STATIC,   SINGULAR, UINT32,   next_expected_nonce,   2) \
+X(a, STATIC,   SINGULAR, UINT32,   received_micros,   3)
 #define PB_Ack_CALLBACK NULL
 #define PB_Ack_DEFAULT NULL
 
@@ -327,10 +565,14 @@ X(a, STATIC,   SINGULAR, UINT32,   ts_millis,         3)
 X(a, STATIC,   SINGULAR, UINT32,   serial_protocol_version,   1) \
 X(a, STATIC,   SINGULAR, UINT32,   uptime_millis,     2) \
 X(a, STATIC,   OPTIONAL, MESSAGE,  build_info,        3) \
-X(a, STATIC,   SINGULAR, BYTES,    flap_character_set,   4)
+X(a, STATIC,   SINGULAR, BYTES,    flap_character_set,   4) \
+X(a, STATIC,   OPTIONAL, MESSAGE,  loop_stats,        5) \
+X(a, STATIC,   REPEATED, MESSAGE,  task_stats,        6)
 #define PB_GeneralState_CALLBACK NULL
 #define PB_GeneralState_DEFAULT NULL
 #define PB_GeneralState_build_info_MSGTYPE PB_GeneralState_BuildInfo
+#define PB_GeneralState_loop_stats_MSGTYPE PB_GeneralState_LoopStats
+#define PB_GeneralState_task_stats_MSGTYPE PB_GeneralState_TaskStats
 
 #define PB_GeneralState_BuildInfo_FIELDLIST(X, a) \
 X(a, STATIC,   SINGULAR, STRING,   git_hash,          1) \
@@ -339,12 +581,45 @@ X(a, STATIC,   SINGULAR, STRING,   build_os,          3)
 #define PB_GeneralState_BuildInfo_CALLBACK NULL
 #define PB_GeneralState_BuildInfo_DEFAULT NULL
 
+#define PB_GeneralState_LoopStats_FIELDLIST(X, a) \
+X(a, STATIC,   SINGULAR, UINT32,   iterations_per_second,   1) \
+X(a, STATIC,   SINGULAR, UINT32,   max_iteration_micros,   2) \
+X(a, STATIC,   SINGULAR, UINT32,   command_queue_high_water,   3) \
+X(a, STATIC,   SINGULAR, UINT32,   step_iteration_permille,   4) \
+X(a, STATIC,   SINGULAR, UINT32,   tick_overruns,     5)
+#define PB_GeneralState_LoopStats_CALLBACK NULL
+#define PB_GeneralState_LoopStats_DEFAULT NULL
+
+#define PB_GeneralState_TaskStats_FIELDLIST(X, a) \
+X(a, STATIC,   SINGULAR, STRING,   name,              1) \
+X(a, STATIC,   SINGULAR, UINT32,   cpu_permille,      2) \
+X(a, STATIC,   SINGULAR, UINT32,   stack_high_water_bytes,   3)
+#define PB_GeneralState_TaskStats_CALLBACK NULL
+#define PB_GeneralState_TaskStats_DEFAULT NULL
+
+#define PB_BaudRateChange_FIELDLIST(X, a) \
+X(a, STATIC,   SINGULAR, UINT32,   baud_rate,         1) \
+X(a, STATIC,   SINGULAR, BOOL,     accepted,          2)
+#define PB_BaudRateChange_CALLBACK NULL
+#define PB_BaudRateChange_DEFAULT NULL
+
+#define PB_CommandApplied_FIELDLIST(X, a) \
+X(a, STATIC,   SINGULAR, UINT32,   nonce,             1) \
+X(a, STATIC,   SINGULAR, UINT32,   received_micros,   2) \
+X(a, STATIC,   SINGULAR, UINT32,   applied_micros,    3)
+#define PB_CommandApplied_CALLBACK NULL
+#define PB_CommandApplied_DEFAULT NULL
+
 #define PB_FromSplitflap_FIELDLIST(X, a) \
 X(a, STATIC,   ONEOF,    MESSAGE,  (payload,splitflap_state,payload.splitflap_state),   1) \
 X(a, STATIC,   ONEOF,    MESSAGE,  (payload,log,payload.log),   2) \
 X(a, STATIC,   ONEOF,    MESSAGE,  (payload,ack,payload.ack),   3) \
 X(a, STATIC,   ONEOF,    MESSAGE,  (payload,supervisor_state,payload.supervisor_state),   4) \
-X(a, STATIC,   ONEOF,    MESSAGE,  (payload,general_state,payload.general_state),   5)
+X(a, STATIC,   ONEOF,    MESSAGE,  (payload,general_state,payload.general_state),   5) \
+X(a, STATIC,   ONEOF,    MESSAGE,  (payload,splitflap_state_delta,payload.splitflap_state_delta),   6) \
+X(a, STATIC,   ONEOF,    MESSAGE,  (payload,baud_rate_change,payload.baud_rate_change),   7) \
+X(a, STATIC,   ONEOF,    MESSAGE,  (payload,log_records,payload.log_records),   8) \
+X(a, STATIC,   ONEOF,    MESSAGE,  (payload,command_applied,payload.command_applied),   9)
 #define PB_FromSplitflap_CALLBACK NULL
 #define PB_FromSplitflap_DEFAULT NULL
 #define PB_FromSplitflap_payload_splitflap_state_MSGTYPE PB_SplitflapState
@@ -352,6 +627,10 @@ X(a, STATIC,   ONEOF,    MESSAGE,  (payload,general_state,payload.general_state)
 #define PB_FromSplitflap_payload_ack_MSGTYPE PB_Ack
 #define PB_FromSplitflap_payload_supervisor_state_MSGTYPE PB_SupervisorState
 #define PB_FromSplitflap_payload_general_state_MSGTYPE PB_GeneralState
+#define PB_FromSplitflap_payload_splitflap_state_delta_MSGTYPE PB_SplitflapStateDelta
+#define PB_FromSplitflap_payload_baud_rate_change_MSGTYPE PB_BaudRateChange
+#define PB_FromSplitflap_payload_log_records_MSGTYPE PB_LogRecords
+#define PB_FromSplitflap_payload_command_applied_MSGTYPE PB_CommandApplied
 
 #define PB_SplitflapCommand_FIELDLIST(X, a) \
 X(a, STATIC,   REPEATED, MESSAGE,  modules,           2) \
@@ -379,21 +658,69 @@ X(a, STATIC,   SINGULAR, UINT32,   reset_nonce,       3)
 #define PB_SplitflapConfig_ModuleConfig_CALLBACK NULL
 #define PB_SplitflapConfig_ModuleConfig_DEFAULT NULL
 
-#define PB_RequestState_FIELDLIST(X, a) \
+#define PB_SplitflapBatch_FIELDLIST(X, a) \
+
+#define PB_SplitflapBatch_CALLBACK NULL
+#define PB_SplitflapBatch_DEFAULT NULL
 
+#define PB_SplitflapBatch_Entry_FIELDLIST(X, a) \
+X(a, STATIC,   SINGULAR, UINT32,   delay_millis,      1) \
+X(a, STATIC,   ONEOF,    MESSAGE,  (payload,splitflap_command,payload.splitflap_command),   2) \
+X(a, STATIC,   ONEOF,    MESSAGE,  (payload,splitflap_config,payload.splitflap_config),   3)
+#define PB_SplitflapBatch_Entry_CALLBACK NULL
+#define PB_SplitflapBatch_Entry_DEFAULT NULL
+#define PB_SplitflapBatch_Entry_payload_splitflap_command_MSGTYPE PB_SplitflapCommand
+#define PB_SplitflapBatch_Entry_payload_splitflap_config_MSGTYPE PB_SplitflapConfig
+
+#define PB_RequestState_FIELDLIST(X, a) \
+X(a, STATIC,   SINGULAR, BOOL,     enable_state_deltas,   1) \
+X(a, STATIC,   SINGULAR, BOOL,     packed_module_state,   2) \
+X(a, STATIC,   SINGULAR, BOOL,     structured_logs,   3)
 #define PB_RequestState_CALLBACK NULL
 #define PB_RequestState_DEFAULT NULL
 
+#define PB_SetBaudRate_FIELDLIST(X, a) \
+X(a, STATIC,   SINGULAR, UINT32,   baud_rate,         1)
+#define PB_SetBaudRate_CALLBACK NULL
+#define PB_SetBaudRate_DEFAULT NULL
+
+#define PB_Subscribe_FIELDLIST(X, a) \
+X(a, STATIC,   SINGULAR, BOOL,     splitflap_state,   1) \
+X(a, STATIC,   SINGULAR, BOOL,     general_state,     2) \
+X(a, STATIC,   SINGULAR, BOOL,     supervisor_state,   3) \
+X(a, STATIC,   SINGULAR, BOOL,     logs,              4) \
+X(a, STATIC,   SINGULAR, UINT32,   min_state_interval_millis,   5) \
+X(a, STATIC,   SINGULAR, UINT32,   max_state_interval_millis,   6) \
+X(a, STATIC,   SINGULAR, UINT32,   general_state_interval_millis,   7) \
+X(a, STATIC,   SINGULAR, BYTES,    modules,           8) \
+X(a, STATIC,   SINGULAR, BOOL,     command_timing,    9)
+#define PB_Subscribe_CALLBACK NULL
+#define PB_Subscribe_DEFAULT NULL
+
+#define PB_Ping_FIELDLIST(X, a) \
+
+#define PB_Ping_CALLBACK NULL
+#define PB_Ping_DEFAULT NULL
+
 #define PB_ToSplitflap_FIELDLIST(X, a) \
 X(a, STATIC,   SINGULAR, UINT32,   nonce,             1) \
 X(a, STATIC,   ONEOF,    MESSAGE,  (payload,splitflap_command,payload.splitflap_command),   2) \
 X(a, STATIC,   ONEOF,    MESSAGE,  (payload,splitflap_config,payload.splitflap_config),   3) \
-X(a, STATIC,   ONEOF,    MESSAGE,  (payload,request_state,payload.request_state),   4)
+X(a, STATIC,   ONEOF,    MESSAGE,  (payload,request_state,payload.request_state),   4) \
+X(a, STATIC,   ONEOF,    MESSAGE,  (payload,set_baud_rate,payload.set_baud_rate),   5) \
+X(a, STATIC,   ONEOF,    MESSAGE,  (payload,subscribe,payload.subscribe),   9) \
+X(a, STATIC,   ONEOF,    MESSAGE,  (payload,ping,payload.ping),   10) \
+X(a, STATIC,   SINGULAR, BOOL,     windowed,          6) \
+X(a, STATIC,   SINGULAR, UINT32,   window_base,       7) \
+X(a, STATIC,   SINGULAR, UINT32,   session_id,       11)
 #define PB_ToSplitflap_CALLBACK NULL
 #define PB_ToSplitflap_DEFAULT NULL
 #define PB_ToSplitflap_payload_splitflap_command_MSGTYPE PB_SplitflapCommand
 #define PB_ToSplitflap_payload_splitflap_config_MSGTYPE PB_SplitflapConfig
 #define PB_ToSplitflap_payload_request_state_MSGTYPE PB_RequestState
+#define PB_ToSplitflap_payload_set_baud_rate_MSGTYPE PB_SetBaudRate
+#define PB_ToSplitflap_payload_subscribe_MSGTYPE PB_Subscribe
+#define PB_ToSplitflap_payload_ping_MSGTYPE PB_Ping
 
 #define PB_PersistentConfiguration_FIELDLIST(X, a) \
 X(a, STATIC,   SINGULAR, UINT32,   version,           1) \
@@ -404,59 +731,98 @@ X(a, STATIC,   REPEATED, UINT32,   module_offset_steps,   3)
 
 extern const pb_msgdesc_t PB_SplitflapState_msg;
 extern const pb_msgdesc_t PB_SplitflapState_ModuleState_msg;
+extern const pb_msgdesc_t PB_SplitflapStateDelta_msg;
+extern const pb_msgdesc_t PB_SplitflapStateDelta_ModuleDelta_msg;
 extern const pb_msgdesc_t PB_Log_msg;
+extern const pb_msgdesc_t PB_LogRecords_Record_msg;
+extern const pb_msgdesc_t PB_LogRecords_msg;
 extern const pb_msgdesc_t PB_Ack_msg;
 extern const pb_msgdesc_t PB_SupervisorState_msg;
 extern const pb_msgdesc_t PB_SupervisorState_PowerChannelState_msg;
 extern const pb_msgdesc_t PB_SupervisorState_FaultInfo_msg;
 extern const pb_msgdesc_t PB_GeneralState_msg;
 extern const pb_msgdesc_t PB_GeneralState_BuildInfo_msg;
+extern const pb_msgdesc_t PB_GeneralState_LoopStats_msg;
+extern const pb_msgdesc_t PB_GeneralState_TaskStats_msg;
+extern const pb_msgdesc_t PB_BaudRateChange_msg;
+extern const pb_msgdesc_t PB_CommandApplied_msg;
 extern const pb_msgdesc_t PB_FromSplitflap_msg;
 extern const pb_msgdesc_t PB_SplitflapCommand_msg;
 extern const pb_msgdesc_t PB_SplitflapCommand_ModuleCommand_msg;
 extern const pb_msgdesc_t PB_SplitflapConfig_msg;
 extern const pb_msgdesc_t PB_SplitflapConfig_ModuleConfig_msg;
+extern const pb_msgdesc_t PB_SplitflapBatch_msg;
+extern const pb_msgdesc_t PB_SplitflapBatch_Entry_msg;
 extern const pb_msgdesc_t PB_RequestState_msg;
+extern const pb_msgdesc_t PB_SetBaudRate_msg;
+extern const pb_msgdesc_t PB_Subscribe_msg;
+extern const pb_msgdesc_t PB_Ping_msg;
 extern const pb_msgdesc_t PB_ToSplitflap_msg;
 extern const pb_msgdesc_t PB_PersistentConfiguration_msg;
 
 /* Defines for backwards compatibility with code written before nanopb-0.4.0 */
 #define PB_SplitflapState_fields &PB_SplitflapState_msg
 #define PB_SplitflapState_ModuleState_fields &PB_SplitflapState_ModuleState_msg
+#define PB_SplitflapStateDelta_fields &PB_SplitflapStateDelta_msg
+#define PB_SplitflapStateDelta_ModuleDelta_fields &PB_SplitflapStateDelta_ModuleDelta_msg
 #define PB_Log_fields &PB_Log_msg
+#define PB_LogRecords_Record_fields &PB_LogRecords_Record_msg
+#define PB_LogRecords_fields &PB_LogRecords_msg
 #define PB_Ack_fields &PB_Ack_msg
 #define PB_SupervisorState_fields &PB_SupervisorState_msg
 #define PB_SupervisorState_PowerChannelState_fields &PB_SupervisorState_PowerChannelState_msg
 #define PB_SupervisorState_FaultInfo_fields &PB_SupervisorState_FaultInfo_msg
 #define PB_GeneralState_fields &PB_GeneralState_msg
 #define PB_GeneralState_BuildInfo_fields &PB_GeneralState_BuildInfo_msg
+#define PB_GeneralState_LoopStats_fields &PB_GeneralState_LoopStats_msg
+#define PB_GeneralState_TaskStats_fields &PB_GeneralState_TaskStats_msg
+#define PB_BaudRateChange_fields &PB_BaudRateChange_msg
+#define PB_CommandApplied_fields &PB_CommandApplied_msg
 #define PB_FromSplitflap_fields &PB_FromSplitflap_msg
 #define PB_SplitflapCommand_fields &PB_SplitflapCommand_msg
 #define PB_SplitflapCommand_ModuleCommand_fields &PB_SplitflapCommand_ModuleCommand_msg
 #define PB_SplitflapConfig_fields &PB_SplitflapConfig_msg
 #define PB_SplitflapConfig_ModuleConfig_fields &PB_SplitflapConfig_ModuleConfig_msg
+#define PB_SplitflapBatch_fields &PB_SplitflapBatch_msg
+#define PB_SplitflapBatch_Entry_fields &PB_SplitflapBatch_Entry_msg
 #define PB_RequestState_fields &PB_RequestState_msg
+#define PB_SetBaudRate_fields &PB_SetBaudRate_msg
+#define PB_Subscribe_fields &PB_Subscribe_msg
+#define PB_Ping_fields &PB_Ping_msg
 #define PB_ToSplitflap_fields &PB_ToSplitflap_msg
 #define PB_PersistentConfiguration_fields &PB_PersistentConfiguration_msg
 
 /* Maximum encoded size of messages (where known) */
-#define PB_Ack_size                              6
-#define PB_FromSplitflap_size                    4340
+#define PB_Ack_size                              18
+#define PB_BaudRateChange_size                   8
+#define PB_CommandApplied_size                   18
+#define PB_FromSplitflap_size                    5369
 #define PB_GeneralState_BuildInfo_size           120
-#define PB_GeneralState_size                     214
+#define PB_GeneralState_LoopStats_size           30
+#define PB_GeneralState_TaskStats_size           29
+#define PB_GeneralState_size                     742
+#define PB_LogRecords_Record_size                32
+#define PB_LogRecords_size                       544
 #define PB_Log_size                              258
 #define PB_PersistentConfiguration_size          1032
-#define PB_RequestState_size                     0
+#define PB_Ping_size                             0
+#define PB_RequestState_size                     6
+#define PB_SetBaudRate_size                      6
+#define PB_SplitflapBatch_Entry_size             2814
+#define PB_SplitflapBatch_size                   0
 #define PB_SplitflapCommand_ModuleCommand_size   5
 #define PB_SplitflapCommand_size                 1787
 #define PB_SplitflapConfig_ModuleConfig_size     9
 #define PB_SplitflapConfig_size                  2805
 #define PB_SplitflapState_ModuleState_size       15
-#define PB_SplitflapState_size                   4337
+#define PB_SplitflapState_size                   5366
+#define PB_SplitflapStateDelta_ModuleDelta_size  20
+#define PB_SplitflapStateDelta_size              875
+#define PB_Subscribe_size                        62
 #define PB_SupervisorState_FaultInfo_size        266
 #define PB_SupervisorState_PowerChannelState_size 12
 #define PB_SupervisorState_size                  347
-#define PB_ToSplitflap_size                      2814
+#define PB_ToSplitflap_size                      2828
 
 #ifdef __cplusplus
 } /* extern "C" */
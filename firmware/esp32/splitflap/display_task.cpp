@@ -45,38 +45,56 @@ void DisplayTask::run() {
 
     tft_.fillScreen(TFT_BLACK);
 
-    // Automatically scale display based on DISPLAY_COLUMNS (see display_layouts.h)
     int32_t module_width = 20;
     int32_t module_height = 26;
     uint8_t module_text_size = 3;
+    uint8_t rows = 0;
 
-    uint8_t rows = ((NUM_MODULES + DISPLAY_COLUMNS - 1) / DISPLAY_COLUMNS);
-
-    if (DISPLAY_COLUMNS > 16 || rows > 6) {
-        module_width = 7;
-        module_height = 10;
-        module_text_size = 1;
-    } else if (DISPLAY_COLUMNS > 10 || rows > 4) {
-        module_width = 14;
-        module_height = 18;
-        module_text_size = 2;
-    }
-
-    tft_.fillRect(X_OFFSET, Y_OFFSET, DISPLAY_COLUMNS * (module_width + 1) + 1, rows * (module_height + 1) + 1, 0x2104);
+    // Modules the grid is currently laid out for; only known once the splitflap task has detected the chain
+    uint8_t layout_modules = 0;
 
     uint8_t module_row, module_col;
     int32_t module_x, module_y;
-    SplitflapState last_state = {};
+    splitflap_task_.addStateListener();
+
+    // Draw every module initially
+    bool state_changed = true;
+    ModuleMask changed_modules;
+    changed_modules.setAll();
     String last_messages[countof(messages_)] = {};
     while(1) {
-        SplitflapState state = splitflap_task_.getState();
-        if (state != last_state) {
+        if (state_changed) {
+            SplitflapState state = splitflap_task_.getState();
+            if (state.num_modules != layout_modules) {
+                // Clear the previous grid
+                tft_.fillRect(X_OFFSET, Y_OFFSET, DISPLAY_COLUMNS * (module_width + 1) + 1, rows * (module_height + 1) + 1, TFT_BLACK);
+                layout_modules = state.num_modules;
+
+                // Automatically scale display based on DISPLAY_COLUMNS (see display_layouts.h) and the detected modules
+                rows = ((layout_modules + DISPLAY_COLUMNS - 1) / DISPLAY_COLUMNS);
+                if (DISPLAY_COLUMNS > 16 || rows > 6) {
+                    module_width = 7;
+                    module_height = 10;
+                    module_text_size = 1;
+                } else if (DISPLAY_COLUMNS > 10 || rows > 4) {
+                    module_width = 14;
+                    module_height = 18;
+                    module_text_size = 2;
+                } else {
+                    module_width = 20;
+                    module_height = 26;
+                    module_text_size = 3;
+                }
+
+                tft_.fillRect(X_OFFSET, Y_OFFSET, DISPLAY_COLUMNS * (module_width + 1) + 1, rows * (module_height + 1) + 1, 0x2104);
+                changed_modules.setAll();
+            }
             tft_.setTextSize(module_text_size);
-            for (uint8_t i = 0; i < NUM_MODULES; i++) {
-                SplitflapModuleState& s = state.modules[i];
-                if (s == last_state.modules[i]) {
+            for (uint8_t i = 0; i < state.num_modules; i++) {
+                if (!changed_modules.test(i)) {
                     continue;
                 }
+                SplitflapModuleState& s = state.modules[i];
 
                 uint16_t background = 0x0000;
                 uint16_t foreground = 0xFFFF;
@@ -140,7 +158,6 @@ void DisplayTask::run() {
                 tft_.setCursor(module_x + 1, module_y + 2);
                 tft_.printf("%c", c);
             }
-            last_state = state;
         }
 
         const int message_height = 10;
@@ -165,7 +182,8 @@ void DisplayTask::run() {
             }
         }
 
-        delay(10);
+        // Woken early by state changes and setMessage()
+        state_changed = splitflap_task_.waitForStateChange(pdMS_TO_TICKS(100), changed_modules);
     }
 }
 
@@ -173,4 +191,7 @@ void DisplayTask::setMessage(uint8_t i, String message) {
     SemaphoreGuard lock(semaphore_);
     assert(i < countof(messages_));
     messages_[i] = message;
+    if (getHandle() != nullptr) {
+        xTaskNotifyGive(getHandle());
+    }
 }
@@ -26,7 +26,8 @@
 #include "display_task.h"
 #include "serial_task.h"
 
-Configuration config;
+// Persists configuration changes on core 0, away from the motion loop
+Configuration config(0);
 
 SplitflapTask splitflapTask(1, LedMode::AUTO);
 SerialTask serialTask(splitflapTask, 0);
@@ -55,6 +56,7 @@ void setup() {
 
   config.setLogger(&serialTask);
   bool loaded = config.loadFromDisk();
+  config.begin();
 
   splitflapTask.begin();
   splitflapTask.setConfiguration(&config);
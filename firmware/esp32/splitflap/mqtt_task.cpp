@@ -163,6 +163,11 @@ void MQTTTask::run() {
     uint32_t last_state_publish = 0;
     SplitflapState last_state = {};
     uint32_t last_availability_publish = 0;
+
+    splitflap_task_.addStateListener();
+    // Set on state changes, cleared once the latest state has been published
+    bool state_pending = true;
+    ModuleMask changed_modules;
     while(1) {
         long now = millis();
         wl_status_t wifi_new_status = WiFi.status();
@@ -182,17 +187,17 @@ void MQTTTask::run() {
             connectMQTT();
         }
         if (mqtt_client_.connected()) {
-            SplitflapState state = splitflap_task_.getState();
+            SplitflapState state = state_pending ? splitflap_task_.getState() : last_state;
             if (state != last_state) {
                 char flap_buf[NUM_MODULES+1];
                 bool all_idle = true;
-                for (uint8_t i = 0; i < NUM_MODULES; i++) {
+                for (uint8_t i = 0; i < state.num_modules; i++) {
                     flap_buf[i] = flaps[state.modules[i].flap_index];
                     if (state.modules[i].moving) {
                         all_idle = false;
                     }
                 }
-                flap_buf[NUM_MODULES] = 0;
+                flap_buf[state.num_modules] = 0;
 
                 if (all_idle && (now - last_state_publish) > 200) {
                     last_state = state;
@@ -200,7 +205,10 @@ void MQTTTask::run() {
                     snprintf(buf, sizeof(buf), "Publishing state: %s", flap_buf);
                     logger_.log(buf);
                     mqtt_client_.publish(MQTT_STATE_TOPIC, flap_buf);
+                    state_pending = false;
                 }
+            } else {
+                state_pending = false;
             }
             if (now > last_availability_publish + 1800000) {
                 mqtt_client_.publish(MQTT_AVAILABILITY_TOPIC, "online", true);
@@ -209,7 +217,9 @@ void MQTTTask::run() {
         }
         mqtt_client_.loop();
         ArduinoOTA.handle();
-        delay(1);
+        if (splitflap_task_.waitForStateChange(1, changed_modules)) {
+            state_pending = true;
+        }
     }
 }
 
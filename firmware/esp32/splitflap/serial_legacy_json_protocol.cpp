@@ -14,16 +14,17 @@
    limitations under the License.
 */
 
-#include "json11.hpp"
-
 #include "serial_legacy_json_protocol.h"
 #include "../proto_gen/splitflap.pb.h"
 
-using namespace json11;
-
 void SerialLegacyJsonProtocol::handleState(const SplitflapState& old_state, const SplitflapState& new_state) {
+    if (pending_init_ && new_state.num_modules > 0) {
+        pending_init_ = false;
+        sendInit(new_state.num_modules);
+    }
+
     bool all_stopped = true;
-    for (uint8_t i = 0; i < NUM_MODULES; i++) {
+    for (uint8_t i = 0; i < new_state.num_modules; i++) {
         all_stopped &= !new_state.modules[i].moving;
     }
     if (pending_move_response_ && all_stopped) {
@@ -35,21 +36,32 @@ void SerialLegacyJsonProtocol::handleState(const SplitflapState& old_state, cons
 }
 
 void SerialLegacyJsonProtocol::log(const char* msg) {
-    Json body = Json::object {
-            {"type", "log"},
-            {"msg", std::string(msg)},
-    };
-    stream_.println(body.dump().c_str());
+    JsonWriter json(tx_buffer_, sizeof(tx_buffer_));
+    // Same layout as json11 produced before
+    json.raw("{\"msg\": ");
+    json.string(msg, strnlen(msg, LEGACY_JSON_MAX_LOG_LENGTH));
+    json.raw(", \"type\": \"log\"}\r\n");
+    send(json);
+}
+
+void SerialLegacyJsonProtocol::send(const JsonWriter& json) {
+    // Buffers are sized for the largest message, so a partial message would be a bug
+    assert(!json.overflowed());
+
+    // A single write, which the UART stream hands to the driver in one go
+    stream_.write((const uint8_t*) json.data(), json.length());
 }
 
 void SerialLegacyJsonProtocol::loop() {
     if (latest_state_.mode == SplitflapMode::MODE_SENSOR_TEST) {
         if (millis() - last_sensor_print_millis_ > 200) {
             last_sensor_print_millis_ = millis();
-            for (uint8_t i = 0; i < NUM_MODULES; i++) {
-                stream_.write(latest_state_.modules[i].home_state ? '1' : '0');
+            JsonWriter line(tx_buffer_, sizeof(tx_buffer_));
+            for (uint8_t i = 0; i < latest_state_.num_modules; i++) {
+                line.raw(latest_state_.modules[i].home_state ? '1' : '0');
             }
-            stream_.println();
+            line.raw("\r\n");
+            send(line);
         }
     }
 
@@ -64,38 +76,41 @@ void SerialLegacyJsonProtocol::loop() {
         if (b == '%') {
             bool new_sensor_test_state = latest_state_.mode != SplitflapMode::MODE_SENSOR_TEST;
             splitflap_task_.setSensorTest(new_sensor_test_state);
-            stream_.print("{\"type\":\"sensor_test\", \"enabled\":");
-            stream_.print(new_sensor_test_state ? "true" : "false");
-            stream_.print("}\n");
+            JsonWriter json(tx_buffer_, sizeof(tx_buffer_));
+            json.raw("{\"type\":\"sensor_test\", \"enabled\":");
+            json.raw(new_sensor_test_state ? "true" : "false");
+            json.raw("}\n");
+            send(json);
         } else if (latest_state_.mode == SplitflapMode::MODE_RUN) {
             switch (b) {
                 case '@':
                     splitflap_task_.resetAll();
                     break;
-                case '#':
-                    stream_.print("{\"type\":\"no_op\"}\n");
-                    stream_.flush();
+                case '#': {
+                    JsonWriter json(tx_buffer_, sizeof(tx_buffer_));
+                    json.raw("{\"type\":\"no_op\"}\n");
+                    send(json);
                     break;
+                }
                 case '=':
                     recv_count_ = 0;
                     break;
-                case '\n':
+                case '\n': {
                     pending_move_response_ = true;
-                    stream_.printf("{\"type\":\"move_echo\", \"dest\":\"");
-                    stream_.flush();
-                    for (uint8_t i = 0; i < recv_count_; i++) {
-                        stream_.write(recv_buffer_[i]);
-                    }
-                    stream_.printf("\"}\n");
-                    stream_.flush();
+                    JsonWriter json(tx_buffer_, sizeof(tx_buffer_));
+                    json.raw("{\"type\":\"move_echo\", \"dest\":");
+                    json.string(recv_buffer_, recv_count_);
+                    json.raw("}\n");
+                    send(json);
                     splitflap_task_.showString(recv_buffer_, recv_count_);
                     break;
+                }
                 case '+':
                     if (recv_count_ == 1) {
-                        for (uint8_t i = 1; i < NUM_MODULES; i++) {
+                        for (uint8_t i = 1; i < latest_state_.num_modules; i++) {
                             recv_buffer_[i] = recv_buffer_[0];
                         }
-                        splitflap_task_.showString(recv_buffer_, NUM_MODULES);
+                        splitflap_task_.showString(recv_buffer_, latest_state_.num_modules);
                     }
                     break;
                 case '>':
@@ -113,7 +128,7 @@ void SerialLegacyJsonProtocol::loop() {
                     // Ignore
                     break;
                 default:
-                    if (recv_count_ > NUM_MODULES - 1) {
+                    if (recv_count_ >= latest_state_.num_modules) {
                         break;
                     }
                     recv_buffer_[recv_count_] = b;
@@ -131,44 +146,52 @@ void SerialLegacyJsonProtocol::sendSupervisorState(PB_SupervisorState& superviso
 }
 
 void SerialLegacyJsonProtocol::init() {
-    stream_.print("\n\n\n");
-    stream_.print("{\"type\":\"init\", \"num_modules\":");
-    stream_.print(NUM_MODULES);
-    stream_.print("}\n");
+    // Sent once the splitflap task has published how many modules it detected
+    pending_init_ = true;
+}
+
+void SerialLegacyJsonProtocol::sendInit(uint8_t num_modules) {
+    JsonWriter json(tx_buffer_, sizeof(tx_buffer_));
+    json.raw("\n\n\n");
+    json.raw("{\"type\":\"init\", \"num_modules\":");
+    json.number(num_modules);
+    json.raw("}\n");
+    send(json);
 }
 
 void SerialLegacyJsonProtocol::dumpStatus(const SplitflapState& state) {
-    stream_.print("{\"type\":\"status\", \"modules\":[");
-    for (uint8_t i = 0; i < NUM_MODULES; i++) {
-        stream_.print("{\"state\":\"");
+    JsonWriter json(tx_buffer_, sizeof(tx_buffer_));
+    json.raw("{\"type\":\"status\", \"modules\":[");
+    for (uint8_t i = 0; i < state.num_modules; i++) {
+        json.raw("{\"state\":\"");
         switch (state.modules[i].state) {
             case NORMAL:
-                stream_.print("normal");
+                json.raw("normal");
                 break;
             case LOOK_FOR_HOME:
-                stream_.print("look_for_home");
+                json.raw("look_for_home");
                 break;
             case SENSOR_ERROR:
-                stream_.print("sensor_error");
+                json.raw("sensor_error");
                 break;
             case PANIC:
-                stream_.print("panic");
+                json.raw("panic");
                 break;
             case STATE_DISABLED:
-                stream_.print("disabled");
+                json.raw("disabled");
                 break;
         }
-        stream_.print("\", \"flap\":\"");
-        stream_.write(flaps[state.modules[i].flap_index]);
-        stream_.print("\", \"count_missed_home\":");
-        stream_.print(state.modules[i].count_missed_home);
-        stream_.print(", \"count_unexpected_home\":");
-        stream_.print(state.modules[i].count_unexpected_home);
-        stream_.print("}");
-        if (i < NUM_MODULES - 1) {
-            stream_.print(", ");
+        json.raw("\", \"flap\":");
+        json.string((const char*) &flaps[state.modules[i].flap_index], 1);
+        json.raw(", \"count_missed_home\":");
+        json.number(state.modules[i].count_missed_home);
+        json.raw(", \"count_unexpected_home\":");
+        json.number(state.modules[i].count_unexpected_home);
+        json.raw("}");
+        if (i < state.num_modules - 1) {
+            json.raw(", ");
         }
     }
-    stream_.print("]}\n");
-    stream_.flush();
+    json.raw("]}\n");
+    send(json);
 }
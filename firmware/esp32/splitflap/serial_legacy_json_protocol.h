@@ -15,9 +15,16 @@
 */
 #pragma once
 
+#include "../core/json_writer.h"
 #include "serial_protocol.h"
 #include "../proto_gen/splitflap.pb.h"
 
+// Longest log message sent; matches the size of Log.msg in the proto protocol
+#define LEGACY_JSON_MAX_LOG_LENGTH 255
+
+#define LEGACY_JSON_STATUS_MAX_LENGTH (64 + NUM_MODULES * 100)
+#define LEGACY_JSON_LOG_MAX_LENGTH (64 + JSON_STRING_MAX_LENGTH(LEGACY_JSON_MAX_LOG_LENGTH))
+
 class SerialLegacyJsonProtocol : public SerialProtocol {
     public:
         SerialLegacyJsonProtocol(SplitflapTask& splitflap_task, Stream& stream) : SerialProtocol(splitflap_task), stream_(stream) {}
@@ -35,7 +42,13 @@ class SerialLegacyJsonProtocol : public SerialProtocol {
         uint8_t recv_count_ = 0;
         char recv_buffer_[NUM_MODULES] = {};
         bool pending_move_response_ = false;
+        bool pending_init_ = false;
         uint32_t last_sensor_print_millis_ = 0;
 
+        // Each message is built here in full and then written out at once
+        char tx_buffer_[LEGACY_JSON_STATUS_MAX_LENGTH > LEGACY_JSON_LOG_MAX_LENGTH ? LEGACY_JSON_STATUS_MAX_LENGTH : LEGACY_JSON_LOG_MAX_LENGTH];
+
+        void send(const JsonWriter& json);
+        void sendInit(uint8_t num_modules);
         void dumpStatus(const SplitflapState& state);
 };
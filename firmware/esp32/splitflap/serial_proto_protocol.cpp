@@ -15,7 +15,7 @@
 */
 #include "../proto_gen/splitflap.pb.h"
 
-#include "crc32.h"
+#include "../core/crc32.h"
 
 #include "pb_encode.h"
 #include "pb_decode.h"
@@ -24,13 +24,95 @@
 static SerialProtoProtocol* singleton_for_packet_serial = 0;
 
 static const uint16_t MIN_STATE_INTERVAL_MILLIS = 100;
+static const uint16_t MIN_STATE_DELTA_INTERVAL_MILLIS = 20;
 static const uint16_t PERIODIC_STATE_INTERVAL_MILLIS = 5000;
+static const uint16_t GENERAL_STATE_INTERVAL_MILLIS = 2000;
+static const uint16_t BAUD_RATE_CONFIRM_TIMEOUT_MILLIS = 2000;
+static const uint32_t MIN_MONITOR_SPEED = 9600;
+
+// ToSplitflap.batch and SplitflapBatch.entries are FT_IGNORE'd by nanopb (batches are decoded an entry at a time
+// below), so there are no generated tag constants for them
+static const uint32_t TO_SPLITFLAP_BATCH_TAG = 8;
+static const uint32_t BATCH_ENTRIES_TAG = 1;
+
+static const uint8_t MAX_PENDING_LOG_RECORDS = sizeof(PB_LogRecords::records) / sizeof(PB_LogRecords::records[0]);
+static_assert(MAX_LOG_ARGS <= sizeof(PB_LogRecords_Record::args) / sizeof(PB_LogRecords_Record::args[0]), "PB_LogRecords_Record can't hold MAX_LOG_ARGS");
+static_assert(MAX_REGISTERED_TASKS <= sizeof(PB_GeneralState::task_stats) / sizeof(PB_GeneralState::task_stats[0]), "PB_GeneralState can't hold MAX_REGISTERED_TASKS");
+
+static const uint8_t MAX_DELTA_MODULES = sizeof(PB_SplitflapStateDelta::modules) / sizeof(PB_SplitflapStateDelta::modules[0]);
+
+static PB_SplitflapState_ModuleState toPbModuleState(const SplitflapModuleState& module_state) {
+    return {
+        .state = (PB_SplitflapState_ModuleState_State) module_state.state,
+        .flap_index = module_state.flap_index,
+        .moving = module_state.moving,
+        .home_state = module_state.home_state,
+        .count_unexpected_home = module_state.count_unexpected_home,
+        .count_missed_home = module_state.count_missed_home,
+    };
+}
+
+// Packed module state layout, see SplitflapState.packed_modules in splitflap.proto
+static const uint8_t PACKED_STATE_MASK = 0x07;
+static const uint8_t PACKED_MOVING = 1 << 3;
+static const uint8_t PACKED_HOME_STATE = 1 << 4;
+static const uint8_t PACKED_HAS_COUNTS = 1 << 5;
+static const uint8_t MAX_PACKED_MODULE_SIZE = 4;
+
+static_assert(sizeof(PB_SplitflapState_packed_modules_t::bytes) >= 255 * MAX_PACKED_MODULE_SIZE, "packed_modules too small for a full chain");
+static_assert(sizeof(PB_SplitflapStateDelta_packed_modules_t::bytes) >= MAX_DELTA_MODULES * (1 + MAX_PACKED_MODULE_SIZE), "packed_modules too small for a full delta");
+
+// Writes the packed form of module_state to out (which must have room for MAX_PACKED_MODULE_SIZE bytes); returns the number of bytes written
+static uint8_t packModuleState(const SplitflapModuleState& module_state, uint8_t* out) {
+    bool has_counts = module_state.count_unexpected_home != 0 || module_state.count_missed_home != 0;
+    out[0] = (module_state.state & PACKED_STATE_MASK)
+        | (module_state.moving ? PACKED_MOVING : 0)
+        | (module_state.home_state ? PACKED_HOME_STATE : 0)
+        | (has_counts ? PACKED_HAS_COUNTS : 0);
+    out[1] = module_state.flap_index;
+    if (!has_counts) {
+        return 2;
+    }
+    out[2] = module_state.count_unexpected_home;
+    out[3] = module_state.count_missed_home;
+    return 4;
+}
+
+// Maps a protobuf module command to a SplitflapTask QCMD_* action (QCMD_NO_OP for unknown/invalid actions)
+static uint8_t toModuleAction(const PB_SplitflapCommand_ModuleCommand& module_command) {
+    switch (module_command.action) {
+        case PB_SplitflapCommand_ModuleCommand_Action_RESET_AND_HOME:
+            return QCMD_RESET_AND_HOME;
+        case PB_SplitflapCommand_ModuleCommand_Action_GO_TO_FLAP:
+            if (module_command.param <= 255 - QCMD_FLAP) {
+                return QCMD_FLAP + module_command.param;
+            }
+            return QCMD_NO_OP;
+        case PB_SplitflapCommand_ModuleCommand_Action_INCREASE_OFFSET_TENTH:
+            return QCMD_INCR_OFFSET_TENTH;
+        case PB_SplitflapCommand_ModuleCommand_Action_INCREASE_OFFSET_HALF:
+            return QCMD_INCR_OFFSET_HALF;
+        case PB_SplitflapCommand_ModuleCommand_Action_SET_OFFSET:
+            return QCMD_SET_OFFSET;
+        case PB_SplitflapCommand_ModuleCommand_Action_NO_OP:
+        default:
+            // Ignore unknown action
+            return QCMD_NO_OP;
+    }
+}
 
-SerialProtoProtocol::SerialProtoProtocol(SplitflapTask& splitflap_task, Stream& stream) :
+SerialProtoProtocol::SerialProtoProtocol(SplitflapTask& splitflap_task, UartStream& stream) :
         SerialProtocol(splitflap_task),
         stream_(stream) {
     packet_serial_.setStream(&stream);
 
+    // Everything at the default rates until the host subscribes
+    subscription_.splitflap_state = true;
+    subscription_.general_state = true;
+    subscription_.supervisor_state = true;
+    subscription_.logs = true;
+    subscribed_modules_.setAll();
+
     // Note: not threadsafe or instance safe!! but PacketSerial requires a legacy function pointer, so we can't
     // use a member, std::function, or lambda with captures
     assert(singleton_for_packet_serial == 0);
@@ -49,10 +131,56 @@ void SerialProtoProtocol::ack(uint32_t nonce) {
     pb_tx_buffer_ = {};
     pb_tx_buffer_.which_payload = PB_FromSplitflap_ack_tag;
     pb_tx_buffer_.payload.ack.nonce = nonce;
+    pb_tx_buffer_.payload.ack.next_expected_nonce = next_expected_nonce_;
+    pb_tx_buffer_.payload.ack.received_micros = received_micros_;
     sendPbTxBuffer();
 }
 
+// Remembers the command/config just submitted for the message with this nonce, if any, to be reported with
+// CommandApplied once the motion loop has applied it
+void SerialProtoProtocol::trackCommandTiming(uint32_t nonce, uint32_t previous_sequence) {
+    uint32_t sequence = splitflap_task_.lastSubmittedCommand();
+    if (!subscription_.command_timing || sequence == previous_sequence) {
+        return;
+    }
+    if (pending_command_timings_count_ == MAX_PENDING_COMMAND_TIMINGS) {
+        memmove(&pending_command_timings_[0], &pending_command_timings_[1], sizeof(pending_command_timings_[0]) * (MAX_PENDING_COMMAND_TIMINGS - 1));
+        pending_command_timings_count_--;
+    }
+    pending_command_timings_[pending_command_timings_count_++] = {nonce, received_micros_, sequence};
+}
+
+void SerialProtoProtocol::sendCommandTimings() {
+    if (pending_command_timings_count_ == 0) {
+        return;
+    }
+    AppliedCommand applied = splitflap_task_.getLastAppliedCommand();
+    uint8_t remaining = 0;
+    for (uint8_t i = 0; i < pending_command_timings_count_; i++) {
+        const PendingCommandTiming& timing = pending_command_timings_[i];
+        // Commands are applied in order, so anything up to the latest applied sequence is done
+        if ((int32_t)(applied.sequence - timing.sequence) < 0) {
+            pending_command_timings_[remaining++] = timing;
+            continue;
+        }
+        pb_tx_buffer_ = {};
+        pb_tx_buffer_.which_payload = PB_FromSplitflap_command_applied_tag;
+        pb_tx_buffer_.payload.command_applied.nonce = timing.nonce;
+        pb_tx_buffer_.payload.command_applied.received_micros = timing.received_micros;
+        pb_tx_buffer_.payload.command_applied.applied_micros = applied.applied_micros;
+        sendPbTxBuffer();
+    }
+    pending_command_timings_count_ = remaining;
+}
+
 void SerialProtoProtocol::log(const char* msg) {
+    if (!subscription_.logs) {
+        return;
+    }
+
+    // Keep text and structured messages in order
+    flushLogRecords();
+
     pb_tx_buffer_ = {};
     pb_tx_buffer_.which_payload = PB_FromSplitflap_log_tag;
 
@@ -61,7 +189,42 @@ void SerialProtoProtocol::log(const char* msg) {
     sendPbTxBuffer();
 }
 
+void SerialProtoProtocol::logRecord(const LogRecord& record) {
+    if (!subscription_.logs) {
+        return;
+    }
+    if (!structured_logs_enabled_) {
+        SerialProtocol::logRecord(record);
+        return;
+    }
+
+    // Records are collected and sent several per message; loop() sends whatever is pending
+    PB_LogRecords_Record& pb_record = pending_log_records_.records[pending_log_records_.records_count++];
+    pb_record.timestamp_millis = record.timestamp_millis;
+    pb_record.format_id = record.format_id;
+    pb_record.args_count = record.arg_count;
+    memcpy(pb_record.args, record.args, record.arg_count * sizeof(record.args[0]));
+
+    if (pending_log_records_.records_count == MAX_PENDING_LOG_RECORDS) {
+        flushLogRecords();
+    }
+}
+
+void SerialProtoProtocol::flushLogRecords() {
+    if (pending_log_records_.records_count == 0) {
+        return;
+    }
+    pb_tx_buffer_ = {};
+    pb_tx_buffer_.which_payload = PB_FromSplitflap_log_records_tag;
+    pb_tx_buffer_.payload.log_records = pending_log_records_;
+    pending_log_records_.records_count = 0;
+    sendPbTxBuffer();
+}
+
 void SerialProtoProtocol::sendSupervisorState(PB_SupervisorState& supervisor_state) {
+    if (!subscription_.supervisor_state) {
+        return;
+    }
     pb_tx_buffer_ = {};
     pb_tx_buffer_.which_payload = PB_FromSplitflap_supervisor_state_tag;
     pb_tx_buffer_.payload.supervisor_state = supervisor_state;
@@ -73,36 +236,40 @@ void SerialProtoProtocol::loop() {
         packet_serial_.update();
     } while (stream_.available());
 
-    {
-        // SplitflapState updates
-            
-        // Rate limit state change transmissions
-        bool state_changed = latest_state_ != last_sent_state_ && millis() - last_sent_state_millis_ >= MIN_STATE_INTERVAL_MILLIS;
+    processBatch();
+    sendCommandTimings();
+    flushLogRecords();
 
-        // Send state periodically or when forced, regardless of rate limit for state changes
-        bool force_send_state = state_requested_ || millis() - last_sent_state_millis_ > PERIODIC_STATE_INTERVAL_MILLIS;
-        if (state_changed || force_send_state) {
-            pb_tx_buffer_ = {};
-            pb_tx_buffer_.which_payload = PB_FromSplitflap_splitflap_state_tag;
-            pb_tx_buffer_.payload.splitflap_state.modules_count = NUM_MODULES;
-            for (uint8_t i = 0; i < NUM_MODULES; i++) {
-                pb_tx_buffer_.payload.splitflap_state.modules[i] = {
-                    .state = (PB_SplitflapState_ModuleState_State) latest_state_.modules[i].state,
-                    .flap_index = latest_state_.modules[i].flap_index,
-                    .moving = latest_state_.modules[i].moving,
-                    .home_state = latest_state_.modules[i].home_state,
-                    .count_unexpected_home = latest_state_.modules[i].count_unexpected_home,
-                    .count_missed_home = latest_state_.modules[i].count_missed_home,
-                };
-            }
-            #ifdef CHAINLINK
-            pb_tx_buffer_.payload.splitflap_state.loopbacks_ok = latest_state_.loopbacks_ok;
-            #endif
+    if (fallback_baud_rate_ != 0 && millis() - baud_rate_changed_millis_ > BAUD_RATE_CONFIRM_TIMEOUT_MILLIS) {
+        // Host never got through at the new rate; go back to the one that worked
+        uint32_t failed_baud_rate = stream_.getBaudRate();
+        stream_.setBaudRate(fallback_baud_rate_);
+        fallback_baud_rate_ = 0;
 
-            sendPbTxBuffer();
+        char buf[200];
+        snprintf(buf, sizeof(buf), "Baud rate %u not confirmed, fell back to %u", failed_baud_rate, stream_.getBaudRate());
+        log(buf);
+    }
+
+    {
+        // SplitflapState updates
 
-            last_sent_state_ = latest_state_;
-            last_sent_state_millis_ = millis();
+        // Rate limit state change transmissions. Deltas are small, so by default they keep up with motion more closely.
+        uint32_t min_interval = subscription_.min_state_interval_millis;
+        if (min_interval == 0) {
+            min_interval = state_deltas_enabled_ ? MIN_STATE_DELTA_INTERVAL_MILLIS : MIN_STATE_INTERVAL_MILLIS;
+        }
+        bool state_changed = subscription_.splitflap_state
+            && millis() - last_sent_state_millis_ >= min_interval
+            && subscribedStateChanged();
+
+        // Send a full state periodically or when forced, regardless of rate limit for state changes. This also serves
+        // as the keyframe that lets hosts resync after a missed delta.
+        uint32_t keyframe_interval = subscription_.max_state_interval_millis != 0 ? subscription_.max_state_interval_millis : PERIODIC_STATE_INTERVAL_MILLIS;
+        bool force_send_state = state_requested_
+            || (subscription_.splitflap_state && millis() - last_sent_keyframe_millis_ > keyframe_interval);
+        if (force_send_state || (state_changed && !(state_deltas_enabled_ && sendStateDelta()))) {
+            sendFullState();
         }
     }
 
@@ -110,7 +277,9 @@ void SerialProtoProtocol::loop() {
         // GeneralState updates
 
         // Send state periodically or when forced
-        bool force_send_state = state_requested_ || millis() - last_sent_general_state_millis_ > 2000;
+        uint32_t interval = subscription_.general_state_interval_millis != 0 ? subscription_.general_state_interval_millis : GENERAL_STATE_INTERVAL_MILLIS;
+        bool force_send_state = state_requested_
+            || (subscription_.general_state && millis() - last_sent_general_state_millis_ > interval);
         if (force_send_state) {
             PB_GeneralState state = {};
 
@@ -125,6 +294,23 @@ void SerialProtoProtocol::loop() {
             memcpy(&state.flap_character_set.bytes, flaps, NUM_FLAPS);
             state.flap_character_set.size = NUM_FLAPS;
 
+            LoopStats loop_stats = splitflap_task_.getLoopStats();
+            state.loop_stats.iterations_per_second = loop_stats.iterations_per_second;
+            state.loop_stats.max_iteration_micros = loop_stats.max_iteration_micros;
+            state.loop_stats.command_queue_high_water = loop_stats.command_queue_high_water;
+            state.loop_stats.step_iteration_permille = loop_stats.step_iteration_permille;
+            state.loop_stats.tick_overruns = loop_stats.tick_overruns;
+            state.has_loop_stats = true;
+
+            TaskStats task_stats[MAX_REGISTERED_TASKS];
+            uint8_t task_count = task_stats_collector_.collect(task_stats);
+            for (uint8_t i = 0; i < task_count && i < sizeof(state.task_stats) / sizeof(state.task_stats[0]); i++) {
+                strlcpy(state.task_stats[i].name, task_stats[i].name, sizeof(state.task_stats[i].name));
+                state.task_stats[i].cpu_permille = task_stats[i].cpu_permille;
+                state.task_stats[i].stack_high_water_bytes = task_stats[i].stack_high_water_bytes;
+                state.task_stats_count++;
+            }
+
             pb_tx_buffer_ = {};
             pb_tx_buffer_.which_payload = PB_FromSplitflap_general_state_tag;
             pb_tx_buffer_.payload.general_state = state;
@@ -140,7 +326,93 @@ void SerialProtoProtocol::loop() {
     }
 }
 
+void SerialProtoProtocol::sendFullState() {
+    pb_tx_buffer_ = {};
+    pb_tx_buffer_.which_payload = PB_FromSplitflap_splitflap_state_tag;
+    if (packed_module_state_) {
+        PB_SplitflapState_packed_modules_t& packed = pb_tx_buffer_.payload.splitflap_state.packed_modules;
+        for (uint8_t i = 0; i < latest_state_.num_modules; i++) {
+            packed.size += packModuleState(latest_state_.modules[i], &packed.bytes[packed.size]);
+        }
+    } else {
+        pb_tx_buffer_.payload.splitflap_state.modules_count = latest_state_.num_modules;
+        for (uint8_t i = 0; i < latest_state_.num_modules; i++) {
+            pb_tx_buffer_.payload.splitflap_state.modules[i] = toPbModuleState(latest_state_.modules[i]);
+        }
+    }
+    #ifdef CHAINLINK
+    pb_tx_buffer_.payload.splitflap_state.loopbacks_ok = latest_state_.loopbacks_ok;
+    #endif
+    pb_tx_buffer_.payload.splitflap_state.sequence = ++state_sequence_;
+
+    sendPbTxBuffer();
+
+    last_sent_state_ = latest_state_;
+    last_sent_state_millis_ = millis();
+    last_sent_keyframe_millis_ = last_sent_state_millis_;
+}
+
+// Whether anything the host is subscribed to changed since the last state sent
+bool SerialProtoProtocol::subscribedStateChanged() {
+    if (latest_state_.num_modules != last_sent_state_.num_modules || latest_state_.mode != last_sent_state_.mode) {
+        return true;
+    }
+    #ifdef CHAINLINK
+    if (latest_state_.loopbacks_ok != last_sent_state_.loopbacks_ok) {
+        return true;
+    }
+    #endif
+    for (uint8_t i = 0; i < latest_state_.num_modules; i++) {
+        if (subscribed_modules_.test(i) && latest_state_.modules[i] != last_sent_state_.modules[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Sends only the (subscribed) modules that changed since the last state sent. Returns false without sending anything if a delta
+// can't represent the change (too many modules changed, or the chain length changed), so a full state must be sent.
+bool SerialProtoProtocol::sendStateDelta() {
+    if (latest_state_.num_modules != last_sent_state_.num_modules) {
+        return false;
+    }
+
+    pb_tx_buffer_ = {};
+    pb_tx_buffer_.which_payload = PB_FromSplitflap_splitflap_state_delta_tag;
+    PB_SplitflapStateDelta& delta = pb_tx_buffer_.payload.splitflap_state_delta;
+    uint8_t changed_count = 0;
+    for (uint8_t i = 0; i < latest_state_.num_modules; i++) {
+        if (subscribed_modules_.test(i) && latest_state_.modules[i] != last_sent_state_.modules[i]) {
+            if (changed_count >= MAX_DELTA_MODULES) {
+                return false;
+            }
+            changed_count++;
+            if (packed_module_state_) {
+                delta.packed_modules.bytes[delta.packed_modules.size++] = i;
+                delta.packed_modules.size += packModuleState(latest_state_.modules[i], &delta.packed_modules.bytes[delta.packed_modules.size]);
+            } else {
+                delta.modules[delta.modules_count].index = i;
+                delta.modules[delta.modules_count].state = toPbModuleState(latest_state_.modules[i]);
+                delta.modules[delta.modules_count].has_state = true;
+                delta.modules_count++;
+            }
+        }
+    }
+    #ifdef CHAINLINK
+    delta.loopbacks_ok = latest_state_.loopbacks_ok;
+    #endif
+    delta.sequence = ++state_sequence_;
+
+    sendPbTxBuffer();
+
+    last_sent_state_ = latest_state_;
+    last_sent_state_millis_ = millis();
+    return true;
+}
+
 void SerialProtoProtocol::handlePacket(const uint8_t* buffer, size_t size) {
+    received_micros_ = micros();
+
     if (size <= 4) {
         // Too small, ignore bad packet
         log("Small packet");
@@ -171,73 +443,83 @@ void SerialProtoProtocol::handlePacket(const uint8_t* buffer, size_t size) {
         return;
     }
 
-    // Always ACK immediately
-    ack(pb_rx_buffer_.nonce);
-    if (pb_rx_buffer_.nonce == last_nonce_) {
-        // Ignore any extraneous retries
-        char buf[200];
-        snprintf(buf, sizeof(buf), "Already handled nonce %u", pb_rx_buffer_.nonce);
-        log(buf);
+    // Any valid message at a newly negotiated baud rate confirms that the host switched too
+    fallback_baud_rate_ = 0;
+
+    // Batches aren't decoded by nanopb (see findBatch), so they show up without a known payload type
+    const uint8_t* batch = nullptr;
+    size_t batch_size = 0;
+    bool is_batch = pb_rx_buffer_.which_payload == 0 && findBatch(buffer, size - 4, &batch, &batch_size);
+    if (is_batch && batch_size > sizeof(batch_buffer_)) {
+        // Not acked, since it was never applied
+        log("Dropped batch, too large");
         return;
     }
+
+    // Commands, configs and batches must be applied in the order they were sent, so while a batch still has delayed
+    // entries to apply, the next one waits. It isn't acked (or accepted into the window), so the host resends it.
+    bool ordered = is_batch
+        || pb_rx_buffer_.which_payload == PB_ToSplitflap_splitflap_command_tag
+        || pb_rx_buffer_.which_payload == PB_ToSplitflap_splitflap_config_tag;
+    bool must_wait = ordered && batchPending();
+
+    if (pb_rx_buffer_.windowed) {
+        // Always ACK immediately, even if dropped, so the host learns where to resume from
+        bool accepted = !must_wait && acceptWindowed(pb_rx_buffer_.session_id, pb_rx_buffer_.nonce, pb_rx_buffer_.window_base);
+        ack(pb_rx_buffer_.nonce);
+        if (!accepted) {
+            return;
+        }
+    } else {
+        if (must_wait) {
+            return;
+        }
+        // ACK immediately
+        ack(pb_rx_buffer_.nonce);
+        if (pb_rx_buffer_.nonce == last_nonce_) {
+            // Ignore any extraneous retries
+            char buf[200];
+            snprintf(buf, sizeof(buf), "Already handled nonce %u", pb_rx_buffer_.nonce);
+            log(buf);
+            return;
+        }
+    }
     last_nonce_ = pb_rx_buffer_.nonce;
     
+    uint32_t previous_sequence = splitflap_task_.lastSubmittedCommand();
     switch (pb_rx_buffer_.which_payload) {
-        case PB_ToSplitflap_splitflap_command_tag: {
-            PB_SplitflapCommand command = pb_rx_buffer_.payload.splitflap_command;
-            if (command.modules_count > 0) {
-                Command c = {};
-                c.command_type = CommandType::MODULES;
-                for (uint8_t i = 0; i < min((int)command.modules_count, NUM_MODULES); i++) {
-                    switch (command.modules[i].action) {
-                        case PB_SplitflapCommand_ModuleCommand_Action_NO_OP:
-                            c.data.module_command[i] = QCMD_NO_OP;
-                            break;
-                        case PB_SplitflapCommand_ModuleCommand_Action_RESET_AND_HOME:
-                            c.data.module_command[i] = QCMD_RESET_AND_HOME;
-                            break;
-                        case PB_SplitflapCommand_ModuleCommand_Action_GO_TO_FLAP:
-                            if (command.modules[i].param <= 255 - QCMD_FLAP) {
-                                c.data.module_command[i] = QCMD_FLAP + command.modules[i].param;
-                            }
-                            break;
-                        case PB_SplitflapCommand_ModuleCommand_Action_INCREASE_OFFSET_TENTH:
-                            c.data.module_command[i] = QCMD_INCR_OFFSET_TENTH;
-                            break;
-                        case PB_SplitflapCommand_ModuleCommand_Action_INCREASE_OFFSET_HALF:
-                            c.data.module_command[i] = QCMD_INCR_OFFSET_HALF;
-                            break;
-                        case PB_SplitflapCommand_ModuleCommand_Action_SET_OFFSET:
-                            c.data.module_command[i] = QCMD_SET_OFFSET;
-                            break;
-                        default:
-                            // Ignore unknown action
-                            break;
-                    }
-                }
-                splitflap_task_.postRawCommand(c);
-            } else if (command.save_all_offsets) {
-                splitflap_task_.saveAllOffsets();
-            }
+        case PB_ToSplitflap_splitflap_command_tag:
+            applyCommand(pb_rx_buffer_.payload.splitflap_command);
+            trackCommandTiming(pb_rx_buffer_.nonce, previous_sequence);
             break;
-        }
-        case PB_ToSplitflap_splitflap_config_tag: {
-            PB_SplitflapConfig config = pb_rx_buffer_.payload.splitflap_config;
-            Command c = {};
-            c.command_type = CommandType::CONFIG;
-            for (uint8_t i = 0; i < min((int)config.modules_count, NUM_MODULES); i++) {
-                ModuleConfig& module_config = c.data.module_configs.config[i];
-                module_config.target_flap_index = config.modules[i].target_flap_index;
-                module_config.movement_nonce = config.modules[i].movement_nonce;
-                module_config.reset_nonce = config.modules[i].reset_nonce;
-            }
-            splitflap_task_.postRawCommand(c);
+        case PB_ToSplitflap_splitflap_config_tag:
+            applyConfig(pb_rx_buffer_.payload.splitflap_config);
+            trackCommandTiming(pb_rx_buffer_.nonce, previous_sequence);
             break;
-        }
         case PB_ToSplitflap_request_state_tag:
             state_requested_ = true;
+            if (pb_rx_buffer_.payload.request_state.enable_state_deltas) {
+                state_deltas_enabled_ = true;
+            }
+            packed_module_state_ = pb_rx_buffer_.payload.request_state.packed_module_state;
+            // Send anything already collected in the format the previous host asked for
+            flushLogRecords();
+            structured_logs_enabled_ = pb_rx_buffer_.payload.request_state.structured_logs;
+            break;
+        case PB_ToSplitflap_set_baud_rate_tag:
+            changeBaudRate(pb_rx_buffer_.payload.set_baud_rate.baud_rate);
+            break;
+        case PB_ToSplitflap_subscribe_tag:
+            applySubscription(pb_rx_buffer_.payload.subscribe);
+            break;
+        case PB_ToSplitflap_ping_tag:
+            // Only acked, so the host can measure round trip time
             break;
         default: {
+            if (is_batch) {
+                startBatch(batch, batch_size);
+                break;
+            }
             char buf[200];
             snprintf(buf, sizeof(buf), "Unknown ToSplitflap type: %d", pb_rx_buffer_.which_payload);
             log(buf);
@@ -246,23 +528,294 @@ void SerialProtoProtocol::handlePacket(const uint8_t* buffer, size_t size) {
     }
 }
 
+void SerialProtoProtocol::applyCommand(const PB_SplitflapCommand& command) {
+    if (command.modules_count > 0) {
+        uint8_t count = min((int)command.modules_count, NUM_MODULES);
+
+        // Pure flap moves can be folded into a still-pending move (later targets win); anything else must
+        // be delivered as-is, so wait for room instead
+        bool mergeable = true;
+        uint8_t touched = 0;
+        for (uint8_t i = 0; i < count; i++) {
+            uint8_t action = toModuleAction(command.modules[i]);
+            if (action != QCMD_NO_OP) {
+                touched++;
+                if (action < QCMD_FLAP) {
+                    mergeable = false;
+                }
+            }
+        }
+
+        if (!mergeable && touched <= MAX_SPARSE_MODULE_ACTIONS) {
+            // Only a few modules touched (e.g. an offset adjustment); send just those
+            Command* c = splitflap_task_.beginCommand(CommandType::MODULE_ACTIONS, SubmitPolicy::WAIT);
+            for (uint8_t i = 0; i < count; i++) {
+                uint8_t action = toModuleAction(command.modules[i]);
+                if (action != QCMD_NO_OP) {
+                    c->data.module_actions.actions[c->data.module_actions.count++] = {i, action};
+                }
+            }
+            splitflap_task_.submitCommand();
+            return;
+        }
+
+        Command* c = splitflap_task_.beginCommand(CommandType::MODULES, mergeable ? SubmitPolicy::MERGE : SubmitPolicy::WAIT);
+        if (c == nullptr) {
+            log("Dropped splitflap command, queue full");
+            return;
+        }
+        for (uint8_t i = 0; i < count; i++) {
+            uint8_t action = toModuleAction(command.modules[i]);
+            // Leave NO_OP entries as-is, in case this is being merged into a pending target
+            if (action != QCMD_NO_OP) {
+                c->data.module_command[i] = action;
+            }
+        }
+        splitflap_task_.submitCommand(mergeable);
+    } else if (command.save_all_offsets) {
+        splitflap_task_.saveAllOffsets();
+    }
+}
+
+void SerialProtoProtocol::applyConfig(const PB_SplitflapConfig& config) {
+    // Each config is a complete snapshot, so a newer one can simply replace a pending one
+    Command* c = splitflap_task_.beginCommand(CommandType::CONFIG, SubmitPolicy::MERGE);
+    if (c == nullptr) {
+        log("Dropped splitflap config, queue full");
+        return;
+    }
+    c->data.module_configs = {};
+    for (uint8_t i = 0; i < min((int)config.modules_count, NUM_MODULES); i++) {
+        ModuleConfig& module_config = c->data.module_configs.config[i];
+        module_config.target_flap_index = config.modules[i].target_flap_index;
+        module_config.movement_nonce = config.modules[i].movement_nonce;
+        module_config.reset_nonce = config.modules[i].reset_nonce;
+    }
+    splitflap_task_.submitCommand(true);
+}
+
+// Looks for a SplitflapBatch in a ToSplitflap message and, if there is one, points batch/length at its encoding.
+bool SerialProtoProtocol::findBatch(const uint8_t* buffer, size_t size, const uint8_t** batch, size_t* length) {
+    pb_istream_t stream = pb_istream_from_buffer(buffer, size);
+    pb_wire_type_t wire_type;
+    uint32_t tag;
+    bool eof;
+    while (pb_decode_tag(&stream, &wire_type, &tag, &eof)) {
+        if (tag != TO_SPLITFLAP_BATCH_TAG || wire_type != PB_WT_STRING) {
+            if (!pb_skip_field(&stream, wire_type)) {
+                return false;
+            }
+            continue;
+        }
+
+        uint32_t batch_length;
+        if (!pb_decode_varint32(&stream, &batch_length) || batch_length > stream.bytes_left) {
+            return false;
+        }
+        *batch = buffer + (size - stream.bytes_left);
+        *length = batch_length;
+        return true;
+    }
+    return false;
+}
+
+// Keeps a copy of a batch to be applied by processBatch(). Only called once any previous batch is used up, and entries
+// that are due right away are applied before returning, so they're never overtaken by a later message.
+void SerialProtoProtocol::startBatch(const uint8_t* batch, size_t length) {
+    memcpy(batch_buffer_, batch, length);
+    batch_size_ = length;
+    batch_offset_ = 0;
+    batch_entry_ready_ = false;
+    batch_entry_due_millis_ = millis();
+    processBatch();
+}
+
+bool SerialProtoProtocol::batchPending() {
+    return batch_size_ > 0 || batch_entry_ready_;
+}
+
+// Decodes the next entry of the pending batch into batch_entry_. Returns false once the batch is used up.
+bool SerialProtoProtocol::decodeNextBatchEntry() {
+    pb_istream_t stream = pb_istream_from_buffer(batch_buffer_ + batch_offset_, batch_size_ - batch_offset_);
+    pb_wire_type_t wire_type;
+    uint32_t tag;
+    bool eof;
+    while (pb_decode_tag(&stream, &wire_type, &tag, &eof)) {
+        if (tag != BATCH_ENTRIES_TAG || wire_type != PB_WT_STRING) {
+            if (!pb_skip_field(&stream, wire_type)) {
+                break;
+            }
+            continue;
+        }
+
+        pb_istream_t entry_stream;
+        if (!pb_make_string_substream(&stream, &entry_stream)) {
+            break;
+        }
+        bool decoded = pb_decode(&entry_stream, PB_SplitflapBatch_Entry_fields, &batch_entry_);
+        if (!pb_close_string_substream(&stream, &entry_stream) || !decoded) {
+            char buf[200];
+            snprintf(buf, sizeof(buf), "Batch entry decoding failed: %s", PB_GET_ERROR(&entry_stream));
+            log(buf);
+            break;
+        }
+        batch_offset_ = batch_size_ - stream.bytes_left;
+        return true;
+    }
+    batch_size_ = 0;
+    batch_offset_ = 0;
+    return false;
+}
+
+// Applies pending batch entries as they come due. Delays are relative to when the previous entry was due, so they
+// don't accumulate loop latency.
+void SerialProtoProtocol::processBatch() {
+    while (batchPending()) {
+        if (!batch_entry_ready_) {
+            if (!decodeNextBatchEntry()) {
+                return;
+            }
+            batch_entry_due_millis_ += batch_entry_.delay_millis;
+            batch_entry_ready_ = true;
+        }
+        if ((int32_t)(millis() - batch_entry_due_millis_) < 0) {
+            return;
+        }
+
+        batch_entry_ready_ = false;
+        switch (batch_entry_.which_payload) {
+            case PB_SplitflapBatch_Entry_splitflap_command_tag:
+                applyCommand(batch_entry_.payload.splitflap_command);
+                break;
+            case PB_SplitflapBatch_Entry_splitflap_config_tag:
+                applyConfig(batch_entry_.payload.splitflap_config);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+// Returns whether a windowed message should be applied. Messages are applied strictly in nonce order (go-back-N):
+// retries of already applied nonces are ignored, and a message after a gap is dropped until the host resends the
+// missing ones.
+bool SerialProtoProtocol::acceptWindowed(uint32_t session_id, uint32_t nonce, uint32_t window_base) {
+    // A new session ID means the host reconnected (or we restarted), so its nonces have nothing to do with the previous
+    // window. The host has also had every nonce before window_base acknowledged, so if we're not within a window of it
+    // the host has moved on without us.
+    if (!window_started_ || session_id != window_session_id_ || next_expected_nonce_ - window_base > MAX_NONCE_WINDOW) {
+        next_expected_nonce_ = window_base;
+        window_session_id_ = session_id;
+        window_started_ = true;
+    }
+
+    if (nonce != next_expected_nonce_) {
+        return false;
+    }
+    // Nonce 0 is never used, so an Ack's next_expected_nonce of 0 only ever comes from firmware without windowing
+    next_expected_nonce_++;
+    if (next_expected_nonce_ == 0) {
+        next_expected_nonce_ = 1;
+    }
+    return true;
+}
+
+void SerialProtoProtocol::applySubscription(const PB_Subscribe& subscription) {
+    subscription_ = subscription;
+    if (!subscription.command_timing) {
+        pending_command_timings_count_ = 0;
+    }
+    if (subscription.modules.size == 0) {
+        subscribed_modules_.setAll();
+    } else {
+        subscribed_modules_ = {};
+        for (uint16_t i = 0; i < NUM_MODULES && i / 8 < subscription.modules.size; i++) {
+            if (subscription.modules.bytes[i / 8] & (1 << (i % 8))) {
+                subscribed_modules_.set(i);
+            }
+        }
+    }
+}
+
+void SerialProtoProtocol::changeBaudRate(uint32_t baud_rate) {
+    uint32_t current_baud_rate = stream_.getBaudRate();
+    bool accepted = baud_rate >= MIN_MONITOR_SPEED && baud_rate <= MAX_MONITOR_SPEED;
+
+    // Reply at the current rate, so the host knows whether to switch
+    pb_tx_buffer_ = {};
+    pb_tx_buffer_.which_payload = PB_FromSplitflap_baud_rate_change_tag;
+    pb_tx_buffer_.payload.baud_rate_change.baud_rate = baud_rate;
+    pb_tx_buffer_.payload.baud_rate_change.accepted = accepted;
+    sendPbTxBuffer();
+
+    if (!accepted || baud_rate == current_baud_rate) {
+        return;
+    }
+
+    // Waits for the reply to go out before switching
+    stream_.setBaudRate(baud_rate);
+    fallback_baud_rate_ = current_baud_rate;
+    baud_rate_changed_millis_ = millis();
+}
+
 void SerialProtoProtocol::sendPbTxBuffer() {
-    // Encode protobuf message to byte buffer
-    pb_ostream_t stream = pb_ostream_from_buffer(tx_buffer_, sizeof(tx_buffer_));
+    // Encode protobuf message straight into the COBS framer, which computes the CRC as bytes go by
+    tx_crc_ = 0;
+    cobs_block_len_ = 0;
+    pb_ostream_t stream = {
+        .callback = &SerialProtoProtocol::pbWriteCallback,
+        .state = this,
+        .max_size = SIZE_MAX,
+        .bytes_written = 0,
+    };
     if (!pb_encode(&stream, PB_FromSplitflap_fields, &pb_tx_buffer_)) {
+        // Terminate the partial frame so the host drops it (bad CRC) and resyncs on the next one
+        flushCobsBlock(true);
         stream_.println(stream.errmsg);
         stream_.flush();
         assert(false);
     }
 
-    // Compute and append little-endian CRC32
-    uint32_t crc = 0;
-    crc32(tx_buffer_, stream.bytes_written, &crc);
-    tx_buffer_[stream.bytes_written + 0] = (crc >> 0)  & 0xFF;
-    tx_buffer_[stream.bytes_written + 1] = (crc >> 8)  & 0xFF;
-    tx_buffer_[stream.bytes_written + 2] = (crc >> 16) & 0xFF;
-    tx_buffer_[stream.bytes_written + 3] = (crc >> 24) & 0xFF;
-
-    // Encode and send proto+CRC as a COBS packet
-    packet_serial_.send(tx_buffer_, stream.bytes_written + 4);
+    // Append little-endian CRC32
+    uint32_t crc = tx_crc_;
+    uint8_t crc_bytes[4] = {
+        (uint8_t)((crc >> 0)  & 0xFF),
+        (uint8_t)((crc >> 8)  & 0xFF),
+        (uint8_t)((crc >> 16) & 0xFF),
+        (uint8_t)((crc >> 24) & 0xFF),
+    };
+    writeFramed(crc_bytes, sizeof(crc_bytes));
+
+    flushCobsBlock(true);
+}
+
+bool SerialProtoProtocol::pbWriteCallback(pb_ostream_t* stream, const pb_byte_t* buffer, size_t count) {
+    SerialProtoProtocol* protocol = static_cast<SerialProtoProtocol*>(stream->state);
+    crc32(buffer, count, &protocol->tx_crc_);
+    protocol->writeFramed(buffer, count);
+    return true;
+}
+
+// COBS-encodes bytes into the current block, writing out each block as soon as its length is known (at the next
+// zero byte, or when it reaches the maximum block length). Same encoding as PacketSerial's COBS::encode.
+void SerialProtoProtocol::writeFramed(const uint8_t* buffer, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (buffer[i] == 0) {
+            flushCobsBlock(false);
+            continue;
+        }
+        cobs_block_[1 + cobs_block_len_++] = buffer[i];
+        if (cobs_block_len_ == sizeof(cobs_block_) - 1) {
+            flushCobsBlock(false);
+        }
+    }
+}
+
+void SerialProtoProtocol::flushCobsBlock(bool terminate_frame) {
+    cobs_block_[0] = cobs_block_len_ + 1;
+    stream_.write(cobs_block_, cobs_block_len_ + 1);
+    cobs_block_len_ = 0;
+    if (terminate_frame) {
+        stream_.write((uint8_t)0);
+    }
 }
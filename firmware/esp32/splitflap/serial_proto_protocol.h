@@ -16,7 +16,11 @@
 #pragma once
 
 #include "PacketSerial.h"
+#include "pb_decode.h"
+#include "pb_encode.h"
 
+#include "../core/task_stats.h"
+#include "../core/uart_stream.h"
 #include "serial_protocol.h"
 #include "../proto_gen/splitflap.pb.h"
 
@@ -28,14 +32,43 @@
  *      - May or may not have software offset support
  * 1:
  *      - GeneralState is introduced (including introduction of serial protocol versioning)
+ * 2:
+ *      - GeneralState includes motion loop stats and per-task CPU/stack stats
+ * 3:
+ *      - SplitflapState has a sequence number
+ *      - SplitflapStateDelta is sent between full SplitflapState keyframes, if enabled via RequestState
+ * 4:
+ *      - Baud rate can be negotiated with SetBaudRate/BaudRateChange
+ * 5:
+ *      - Windowed ToSplitflap messages (several in flight, applied in nonce order) with cumulative Ack.next_expected_nonce
+ * 6:
+ *      - SplitflapBatch of commands/configs with relative delays
+ * 7:
+ *      - Module states can be sent bit-packed in SplitflapState/SplitflapStateDelta.packed_modules, if requested via RequestState
+ * 8:
+ *      - Structured log messages can be sent as LogRecords (format ID + raw arguments), if requested via RequestState
+ * 9:
+ *      - Subscribe lets the host choose which messages are sent unprompted, their rates, and which modules' changes count
+ * 10:
+ *      - Ack includes the time the message was received, Ping is acked without doing anything, and CommandApplied
+ *        reports when each command/config was applied, if subscribed to
+ * 11:
+ *      - Windowed ToSplitflap messages carry the host's session_id; a new session restarts the window
 */
-#define SERIAL_PROTOCOL_VERSION (1);
+#define SERIAL_PROTOCOL_VERSION (11);
+
+// How far a windowed host's window base may fall behind the next expected nonce before the window is restarted
+#define MAX_NONCE_WINDOW 32
+
+// Commands/configs waiting to be reported with CommandApplied; the oldest is dropped if the motion loop falls behind
+#define MAX_PENDING_COMMAND_TIMINGS 8
 
 class SerialProtoProtocol : public SerialProtocol {
     public:
-        SerialProtoProtocol(SplitflapTask& splitflap_task, Stream& stream);
+        SerialProtoProtocol(SplitflapTask& splitflap_task, UartStream& stream);
         ~SerialProtoProtocol() {}
         void log(const char* msg) override;
+        void logRecord(const LogRecord& record) override;
         void loop() override;
         void handleState(const SplitflapState& old_state, const SplitflapState& new_state) override;
         void sendSupervisorState(PB_SupervisorState& supervisor_state) override;
@@ -43,25 +76,94 @@ class SerialProtoProtocol : public SerialProtocol {
         void init();
     
     private:
-        Stream& stream_;
+        UartStream& stream_;
         PB_FromSplitflap pb_tx_buffer_;
         PB_ToSplitflap pb_rx_buffer_;
 
-        uint8_t tx_buffer_[PB_FromSplitflap_size + 4]; // Max message size + CRC32
+        // Outgoing messages are encoded, CRC'd and COBS-framed on the fly, so only the current COBS block (code byte +
+        // up to 254 data bytes) is buffered rather than the whole encoded message
+        uint8_t cobs_block_[255];
+        uint8_t cobs_block_len_ = 0;
+        uint32_t tx_crc_ = 0;
 
         PacketSerial_<COBS, 0, (PB_ToSplitflap_size + 4) * 2 + 10> packet_serial_;
 
         uint32_t last_nonce_;
 
+        // Device time when the packet being handled was received
+        uint32_t received_micros_ = 0;
+
+        struct PendingCommandTiming {
+            uint32_t nonce;
+            uint32_t received_micros;
+            uint32_t sequence;
+        };
+        PendingCommandTiming pending_command_timings_[MAX_PENDING_COMMAND_TIMINGS];
+        uint8_t pending_command_timings_count_ = 0;
+
+        // Next nonce to apply from a windowed host, once a window has been started by the session with this ID
+        bool window_started_ = false;
+        uint32_t window_session_id_ = 0;
+        uint32_t next_expected_nonce_ = 0;
+
         SplitflapState latest_state_ = {};
         SplitflapState last_sent_state_ = {};
         uint32_t last_sent_state_millis_ = 0;
+        uint32_t last_sent_keyframe_millis_ = 0;
+        uint32_t state_sequence_ = 0;
+
+        // Set once the host asks for deltas; stays on since hosts that don't understand them never ask
+        bool state_deltas_enabled_ = false;
+
+        // Whether module states are sent as packed_modules bytes; follows the most recent RequestState, so a host that
+        // doesn't know about packing gets ModuleState messages again
+        bool packed_module_state_ = false;
+
+        // Whether log records are sent as LogRecords rather than formatted text; follows the most recent RequestState
+        bool structured_logs_enabled_ = false;
+        PB_LogRecords pending_log_records_ = {};
 
         uint32_t last_sent_general_state_millis_ = 0;
 
+        // What the host asked to be sent unprompted (see Subscribe in splitflap.proto); 0 intervals mean the defaults
+        PB_Subscribe subscription_ = {};
+        ModuleMask subscribed_modules_ = {};
+        TaskStatsCollector task_stats_collector_;
+
         bool state_requested_;
 
+        // Batch being applied: the encoded SplitflapBatch, decoded one entry at a time as entries come due
+        uint8_t batch_buffer_[PB_ToSplitflap_size];
+        size_t batch_size_ = 0;
+        size_t batch_offset_ = 0;
+        PB_SplitflapBatch_Entry batch_entry_;
+        bool batch_entry_ready_ = false;
+        uint32_t batch_entry_due_millis_ = 0;
+
+        // Baud rate to fall back to if a negotiated baud rate change isn't confirmed in time (0 if none pending)
+        uint32_t fallback_baud_rate_ = 0;
+        uint32_t baud_rate_changed_millis_ = 0;
+
         void sendPbTxBuffer();
+        void writeFramed(const uint8_t* buffer, size_t count);
+        void flushCobsBlock(bool terminate_frame);
+        static bool pbWriteCallback(pb_ostream_t* stream, const pb_byte_t* buffer, size_t count);
+        void flushLogRecords();
+        void sendFullState();
+        bool sendStateDelta();
+        bool subscribedStateChanged();
         void handlePacket(const uint8_t* buffer, size_t size);
         void ack(uint32_t nonce);
+        void trackCommandTiming(uint32_t nonce, uint32_t previous_sequence);
+        void sendCommandTimings();
+        bool acceptWindowed(uint32_t session_id, uint32_t nonce, uint32_t window_base);
+        void changeBaudRate(uint32_t baud_rate);
+        void applySubscription(const PB_Subscribe& subscription);
+        void applyCommand(const PB_SplitflapCommand& command);
+        void applyConfig(const PB_SplitflapConfig& config);
+        bool findBatch(const uint8_t* buffer, size_t size, const uint8_t** batch, size_t* length);
+        void startBatch(const uint8_t* batch, size_t length);
+        bool batchPending();
+        bool decodeNextBatchEntry();
+        void processBatch();
 };
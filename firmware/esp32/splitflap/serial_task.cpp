@@ -17,22 +17,27 @@
 
 #include "../core/uart_stream.h"
 
+// Log ring entry types
+static const uint8_t LOG_ENTRY_TEXT = 0;
+static const uint8_t LOG_ENTRY_RECORD = 1;
+
+// Longer text messages are truncated; matches the size of Log.msg
+static const uint16_t MAX_LOG_TEXT_LENGTH = 255;
+
 SerialTask::SerialTask(SplitflapTask& splitflap_task, const uint8_t task_core) :
         Task("Serial", 16000, 1, task_core),
         Logger(),
         splitflap_task_(splitflap_task),
-        stream_(),
+        stream_(task_core),
         legacy_protocol_(splitflap_task_, stream_),
         proto_protocol_(splitflap_task_, stream_) {
-    log_queue_ = xQueueCreate(10, sizeof(std::string *));
-    assert(log_queue_ != NULL);
-
     supervisor_state_queue_ = xQueueCreate(1, sizeof(PB_SupervisorState));
     assert(supervisor_state_queue_ != NULL);
 }
 
 void SerialTask::run() {
-    stream_.begin();
+    // Wake up as soon as serial data arrives
+    stream_.begin(getHandle());
 
     // Start in legacy protocol mode
     legacy_protocol_.init();
@@ -57,40 +62,76 @@ void SerialTask::run() {
 
     splitflap_task_.setLogger(this);
 
+    splitflap_task_.addStateListener();
+
     SplitflapState last_state = {};
+    SplitflapState new_state = {};
+    uint32_t state_generation = 0;
+    ModuleMask changed_modules;
     while(1) {
-        SplitflapState new_state = splitflap_task_.getState();
-
-        if (new_state != last_state) {
+        if (splitflap_task_.getStateIfChanged(state_generation, new_state) && new_state != last_state) {
             current_protocol->handleState(last_state, new_state);
             last_state = new_state;
         }
 
-        current_protocol->loop();
+        drainLogs(current_protocol);
 
-        std::string* log_string;
-        while (xQueueReceive(log_queue_, &log_string, 0) == pdTRUE) {
-            current_protocol->log(log_string->c_str());
-            delete log_string;
-        }
+        current_protocol->loop();
 
         PB_SupervisorState supervisor_state;
         if (xQueueReceive(supervisor_state_queue_, &supervisor_state, 0) == pdTRUE) {
             current_protocol->sendSupervisorState(supervisor_state);
         }
-        delay(1);
+
+        // Serial input, logs and state changes all wake this task, so this timeout only bounds the latency of
+        // rate-limited and periodic sends
+        splitflap_task_.waitForStateChange(pdMS_TO_TICKS(10), changed_modules);
+    }
+}
+
+void SerialTask::drainLogs(SerialProtocol* protocol) {
+    log_ring_.drain([protocol] (uint8_t type, const uint8_t* data, uint16_t length) {
+        switch (type) {
+            case LOG_ENTRY_TEXT: {
+                char msg[MAX_LOG_TEXT_LENGTH + 1];
+                memcpy(msg, data, length);
+                msg[length] = 0;
+                protocol->log(msg);
+                break;
+            }
+            case LOG_ENTRY_RECORD: {
+                LogRecord record;
+                memcpy(&record, data, sizeof(record));
+                protocol->logRecord(record);
+                break;
+            }
+        }
+    });
+
+    uint32_t dropped = log_ring_.dropped();
+    if (dropped != reported_log_drops_) {
+        char buf[200];
+        snprintf(buf, sizeof(buf), "Dropped %u log messages, log buffer full", dropped - reported_log_drops_);
+        protocol->log(buf);
+        reported_log_drops_ = dropped;
     }
 }
 
 void SerialTask::log(const char* msg) {
-    // Allocate a string for the duration it's in the queue; it is free'd by the queue consumer
-    std::string* msg_str = new std::string(msg);
+    // Copied into the ring (or dropped if it's full), so logging never allocates or blocks
+    if (log_ring_.push(LOG_ENTRY_TEXT, msg, strnlen(msg, MAX_LOG_TEXT_LENGTH))) {
+        xTaskNotifyGive(getHandle());
+    }
+}
 
-    // Put string in queue (or drop if full to avoid blocking)
-    xQueueSendToBack(log_queue_, &msg_str, 0);
+void SerialTask::logRecord(const LogRecord& record) {
+    if (log_ring_.push(LOG_ENTRY_RECORD, &record, sizeof(record))) {
+        xTaskNotifyGive(getHandle());
+    }
 }
 
 void SerialTask::sendSupervisorState(PB_SupervisorState& supervisor_state) {
     // Only queue the latest supervisor state
     xQueueOverwrite(supervisor_state_queue_, &supervisor_state);
+    xTaskNotifyGive(getHandle());
 }
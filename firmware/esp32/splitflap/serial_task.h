@@ -17,6 +17,7 @@
 
 #include "config.h"
 
+#include "../core/log_ring.h"
 #include "../core/splitflap_task.h"
 #include "../core/task.h"
 #include "../core/uart_stream.h"
@@ -32,6 +33,7 @@ class SerialTask : public Task<SerialTask>, public Logger {
         virtual ~SerialTask() {};
         
         void log(const char* msg) override;
+        void logRecord(const LogRecord& record) override;
 
         void sendSupervisorState(PB_SupervisorState& supervisor_state);
 
@@ -45,8 +47,12 @@ class SerialTask : public Task<SerialTask>, public Logger {
         SerialLegacyJsonProtocol legacy_protocol_;
         SerialProtoProtocol proto_protocol_;
 
-        QueueHandle_t log_queue_;
+        // Text and structured log messages from any task, in the order they were logged
+        LogRing<4096> log_ring_;
+        uint32_t reported_log_drops_ = 0;
+
         QueueHandle_t supervisor_state_queue_;
 
+        void drainLogs(SerialProtocol* protocol);
         void dumpStatus(SplitflapState& state);
 };
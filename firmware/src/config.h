@@ -17,6 +17,17 @@
 // Whether to force a full rotation when the same letter is specified again
 #define FORCE_FULL_ROTATION true
 
+// ESP32 only: whether to run the motion loop on a fixed-rate hardware timer tick instead of as fast as possible.
+// Stepping, I/O and state publication then follow a fixed per-tick schedule, so step timing no longer depends on
+// NUM_MODULES or how busy the command queues are. MOTION_TICK_MICROS must leave room for stepping and I/O of the
+// whole chain each tick; missed ticks are reported as tick_overruns in the GeneralState loop stats.
+#ifndef MOTION_FIXED_TICK
+#define MOTION_FIXED_TICK false
+#endif
+#ifndef MOTION_TICK_MICROS
+#define MOTION_TICK_MICROS (100)
+#endif
+
 // Whether to use/expect a home sensor. Enable for auto-calibration via home
 // sensor feedback. Disable for basic open-loop control (useful when first
 // testing the split-flap, since home calibration can be tricky to fine tune)
@@ -107,6 +118,11 @@ const uint8_t flaps[NUM_FLAPS] = {
 #elif defined(ESP32)
   #define NEOPIXEL_PIN (13)
   #define MONITOR_SPEED 230400
+  // Highest rate a host may negotiate over the proto protocol; the limit is usually the USB-UART bridge (e.g. CH340
+  // and CP2102N both handle 2Mbaud)
+  #ifndef MAX_MONITOR_SPEED
+  #define MAX_MONITOR_SPEED 2000000
+  #endif
 #endif
 
 /*************************/
@@ -173,4 +189,10 @@ const uint8_t flaps[NUM_FLAPS] = {
 
 #define NUM_LOOPBACKS (NUM_MODULES / 3)
 #define CHAINLINK_ENFORCE_LOOPBACKS 1
+
+// Detect how many Chainlink Drivers are actually connected at startup, so NUM_MODULES only needs to be the maximum
+// chain length and the same firmware can drive any shorter chain. Base and driver tester builds have a fixed setup.
+#if !defined(CHAINLINK_BASE) && !defined(CHAINLINK_DRIVER_TESTER)
+#define CHAINLINK_DETECT_CHAIN_LENGTH 1
+#endif
 #endif
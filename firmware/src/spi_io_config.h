@@ -127,6 +127,11 @@ static char moduleBuffer[NUM_MODULES][sizeof(SplitflapModule)];
 
 SplitflapModule* modules[NUM_MODULES];
 
+// Number of modules actually connected. NUM_MODULES unless the chain length is detected at startup (see
+// CHAINLINK_DETECT_CHAIN_LENGTH), in which case NUM_MODULES is just the maximum and only the first num_modules
+// modules are driven.
+uint8_t num_modules = NUM_MODULES;
+
 #ifdef CHAINLINK
 static const uint8_t MOTOR_OFFSET[] = {0, 0, 1, 2, 3, 3};
 #endif
@@ -282,6 +287,10 @@ void chainlink_set_led(uint8_t moduleIndex, bool on) {
   }
 }
 
+static uint8_t chainlink_num_loopbacks() {
+  return num_modules / 3;
+}
+
 static uint8_t chainlink_loopbackMotorByte(uint8_t loopbackIndex) {
   return MOTOR_BUFFER_LENGTH - 1 - (loopbackIndex / 2) * 4 - (((loopbackIndex % 2) == 0) ? 1 : 2);
 }
@@ -303,7 +312,7 @@ bool chainlink_test_startup_loopback(bool results[NUM_LOOPBACKS]) {
     motor_sensor_io();
     motor_sensor_io();
 
-    for (uint8_t i = 0; i < NUM_LOOPBACKS; i++) {
+    for (uint8_t i = 0; i < chainlink_num_loopbacks(); i++) {
       results[i] = ((sensor_buffer[chainlink_loopbackSensorByte(i)] & chainlink_loopbackSensorBitMask(i))) == 0;
       success &= results[i];
     }
@@ -322,7 +331,7 @@ void chainlink_set_loopback(uint8_t loop_out_index) {
  */
 bool chainlink_validate_loopback(uint8_t loop_out_index, bool results[NUM_LOOPBACKS]) {
     bool success = true;
-    for (uint8_t loop_in_index = 0; loop_in_index < NUM_LOOPBACKS; loop_in_index++) {
+    for (uint8_t loop_in_index = 0; loop_in_index < chainlink_num_loopbacks(); loop_in_index++) {
       uint8_t expected_bit_mask = (loop_out_index == loop_in_index) ? chainlink_loopbackSensorBitMask(loop_in_index) : 0;
       uint8_t actual_bit_mask = sensor_buffer[chainlink_loopbackSensorByte(loop_in_index)] & chainlink_loopbackSensorBitMask(loop_in_index);
 
@@ -342,7 +351,7 @@ bool chainlink_test_all_loopbacks(bool loopback_result[NUM_LOOPBACKS][NUM_LOOPBA
     bool loopback_success = true;
 
     // Turn one loopback bit on at a time and make sure only that loopback bit is set
-    for (uint8_t loop_out_index = 0; loop_out_index < NUM_LOOPBACKS; loop_out_index++) {
+    for (uint8_t loop_out_index = 0; loop_out_index < chainlink_num_loopbacks(); loop_out_index++) {
       chainlink_set_loopback(loop_out_index);
       motor_sensor_io();
       motor_sensor_io();
@@ -354,6 +363,57 @@ bool chainlink_test_all_loopbacks(bool loopback_result[NUM_LOOPBACKS][NUM_LOOPBA
     return loopback_success;
 }
 
+#if CHAINLINK_DETECT_CHAIN_LENGTH
+/**
+ * Counts the connected Chainlink Drivers by toggling the first loopback of each successive driver and checking that it
+ * reads back. Inputs past the end of the chain don't follow the toggled output, so the first driver that doesn't
+ * respond marks the end of the chain. Returns the number of connected modules (0 if none could be detected).
+ */
+uint8_t chainlink_detect_num_modules() {
+  memset(motor_buffer, 0, MOTOR_BUFFER_LENGTH);
+  motor_sensor_io();
+
+  uint8_t num_drivers = 0;
+  for (; num_drivers < NUM_MODULES / 6; num_drivers++) {
+    uint8_t loopback = num_drivers * 2;
+    uint8_t sensor_byte = chainlink_loopbackSensorByte(loopback);
+    uint8_t sensor_mask = chainlink_loopbackSensorBitMask(loopback);
+
+    chainlink_set_loopback(loopback);
+    motor_sensor_io();
+    motor_sensor_io();
+    bool read_on = sensor_buffer[sensor_byte] & sensor_mask;
+
+    motor_buffer[chainlink_loopbackMotorByte(loopback)] &= ~chainlink_loopbackMotorBitMask(loopback);
+    motor_sensor_io();
+    motor_sensor_io();
+    bool read_off = sensor_buffer[sensor_byte] & sensor_mask;
+
+    if (!read_on || read_off) {
+      break;
+    }
+  }
+  return num_drivers * 6;
+}
+
+/**
+ * Limits SPI transfers to the given number of connected modules. Module 0 is closest to the ESP32, so the connected
+ * modules' motor data is at the end of motor_buffer and their sensor data at the start of sensor_buffer.
+ */
+void chainlink_set_num_modules(uint8_t count) {
+  assert(count > 0 && count <= NUM_MODULES && count % 6 == 0);
+  num_modules = count;
+
+  uint16_t motor_length = count * 2 / 3;
+  uint16_t sensor_length = count / 6;
+  // Each driver has 4 motor bytes, so the transmit buffer stays word-aligned for DMA
+  tx_transaction.length = motor_length * 8;
+  tx_transaction.tx_buffer = motor_buffer + MOTOR_BUFFER_LENGTH - motor_length;
+  rx_transaction.length = sensor_length * 8;
+  rx_transaction.rxlength = sensor_length * 8;
+}
+#endif
+
 #endif
 
 #endif
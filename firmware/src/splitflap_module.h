@@ -117,7 +117,8 @@ class SplitflapModule {
   void FindAndRecalibrateHome();
   void ResetErrorCounters();
   void ResetState();
-  inline void Update();
+  inline bool Update();
+  inline bool Update(unsigned long now);
   void Init();
   bool GetHomeState();
   void Disable();
@@ -266,12 +267,16 @@ inline void SplitflapModule::FindAndRecalibrateHome() {
 }
 
 __attribute__((always_inline))
-inline void SplitflapModule::Update() {
+inline bool SplitflapModule::Update() {
+    return Update(micros());
+}
+
+__attribute__((always_inline))
+inline bool SplitflapModule::Update(unsigned long now) {
     if (state == PANIC || state == STATE_DISABLED) {
-        return;
+        return false;
     }
 
-    unsigned long now = micros();
     unsigned long delta_time = now - last_update_micros;
     if (delta_time >= current_period) {
         last_update_micros = now;
@@ -405,8 +410,9 @@ inline void SplitflapModule::Update() {
             Panic("current_step >= STEPS_PER_REVOLUTION");
         }
 #endif
+        return true;
     }
-    return;
+    return false;
 }
 
 void SplitflapModule::ResetErrorCounters() {
@@ -0,0 +1,105 @@
+/*
+   Copyright 2024 Scott Bezek and the splitflap contributors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+/*
+ * Host-side check of the portable (non-ESP32) crc32() against zlib, plus a throughput comparison.
+ * Build and run with `make` in this directory; exits non-zero on any mismatch.
+ */
+#include <chrono>
+#include <random>
+#include <stdio.h>
+#include <vector>
+
+#include <zlib.h>
+
+#include "../../esp32/core/crc32.h"
+
+static const size_t MAX_LENGTH = 4096;
+static const int ITERATIONS = 20000;
+
+// Compares a single call, and the same data split into random chunks, against zlib
+static bool check(const uint8_t* data, size_t length, std::mt19937& rng) {
+    uint32_t expected = ::crc32(0L, data, length);
+
+    uint32_t actual = 0;
+    crc32(data, length, &actual);
+    if (actual != expected) {
+        printf("FAIL: length %zu: got %08x, expected %08x\n", length, actual, expected);
+        return false;
+    }
+
+    uint32_t chained = 0;
+    size_t offset = 0;
+    while (offset < length) {
+        size_t chunk = std::uniform_int_distribution<size_t>(0, length - offset)(rng);
+        crc32(data + offset, chunk, &chained);
+        offset += chunk;
+    }
+    if (chained != expected) {
+        printf("FAIL: length %zu in chunks: got %08x, expected %08x\n", length, chained, expected);
+        return false;
+    }
+    return true;
+}
+
+static double megabytesPerSecond(const std::vector<uint8_t>& data, bool use_zlib) {
+    const int rounds = 2000;
+    uint32_t sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++) {
+        if (use_zlib) {
+            sink ^= ::crc32(0L, data.data(), data.size());
+        } else {
+            uint32_t crc = 0;
+            crc32(data.data(), data.size(), &crc);
+            sink ^= crc;
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    // Keep the loop from being optimized away
+    if (sink == 0x12345678) {
+        printf(" ");
+    }
+    return data.size() * (double)rounds / seconds / 1e6;
+}
+
+int main() {
+    std::mt19937 rng(1);
+    // Extra bytes in front, so data can start at every alignment
+    std::vector<uint8_t> buffer(MAX_LENGTH + 8);
+    for (uint8_t& b : buffer) {
+        b = rng();
+    }
+
+    int failures = 0;
+    for (int i = 0; i < ITERATIONS; i++) {
+        size_t alignment = rng() % 8;
+        size_t length = i < 64 ? i : std::uniform_int_distribution<size_t>(0, MAX_LENGTH)(rng);
+        if (!check(buffer.data() + alignment, length, rng)) {
+            failures++;
+        }
+    }
+    if (failures > 0) {
+        printf("%d of %d checks failed\n", failures, ITERATIONS);
+        return 1;
+    }
+    printf("%d checks match zlib\n", ITERATIONS);
+
+    std::vector<uint8_t> block(buffer.begin(), buffer.begin() + MAX_LENGTH);
+    printf("crc32: %.0f MB/s, zlib: %.0f MB/s (%zu byte blocks)\n",
+        megabytesPerSecond(block, false), megabytesPerSecond(block, true), block.size());
+    return 0;
+}
@@ -2,10 +2,13 @@ import argparse
 from cobs import cobs
 from collections import (
     defaultdict,
+    deque,
 )
 from contextlib import contextmanager
 from enum import Enum
 import logging
+import json
+import math
 import os
 from queue import (
     Empty,
@@ -13,9 +16,11 @@ from queue import (
     Queue,
 )
 from random import randint
+import re
 import serial
 import serial.tools.list_ports
 import six
+import struct
 import sys
 from threading import (
     Thread,
@@ -29,8 +34,39 @@ sys.path.append(os.path.join(software_root, 'proto_gen'))
 
 from proto_gen import splitflap_pb2
 
+# Structured log formats, generated from firmware/esp32/core/log_formats.h by the firmware build
+with open(os.path.join(software_root, 'proto_gen', 'log_formats.json')) as f:
+    LOG_FORMATS = {int(format_id): entry['format'] for format_id, entry in json.load(f).items()}
+
+_LOG_CONVERSION = re.compile(r'%[-+ #0-9.]*[diuxXcf%]')
+
 SPLITFLAP_BAUD = 230400
 
+# Device falls back to the previous baud rate if it doesn't hear from the host within 2 seconds of switching
+BAUD_RATE_CONFIRM_TIMEOUT = 1.0
+
+
+class LatencyStats(object):
+    """Keeps the most recent latency samples (in seconds) and reports percentiles over them."""
+
+    def __init__(self, max_samples=1000):
+        self._samples = deque(maxlen=max_samples)
+        self._lock = Lock()
+
+    def add(self, seconds):
+        with self._lock:
+            self._samples.append(seconds)
+
+    def percentiles(self):
+        """Returns a dict with the sample count and the p50/p90/p99/max latencies (None if there are no samples)."""
+        with self._lock:
+            samples = sorted(self._samples)
+        result = {'count': len(samples)}
+        for (name, fraction) in (('p50', 0.5), ('p90', 0.9), ('p99', 0.99), ('max', 1.0)):
+            # Nearest-rank percentile
+            result[name] = samples[max(0, math.ceil(fraction * len(samples)) - 1)] if samples else None
+        return result
+
 
 class Splitflap(object):
 
@@ -41,6 +77,9 @@ class Splitflap(object):
 
     RETRY_TIMEOUT = 0.25
 
+    # Max messages in flight at once. Firmware that predates windowed messages is driven stop-and-wait instead.
+    WINDOW_SIZE = 8
+
     _LEGACY_ALPHABET = [
         ' ', 'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H', 'I',
         'J', 'K', 'L', 'M', 'N', 'O', 'P', 'Q', 'R', 'S',
@@ -53,7 +92,12 @@ class Splitflap(object):
         self._logger = logging.getLogger('splitflap')
         self._out_q = Queue()
         self._ack_q = Queue()
-        self._next_nonce = randint(0, 255)
+        # Random, so the device can tell this session's messages from the previous connection's even without the
+        # session ID (older firmware). Nonce 0 is never used, so an ack's next_expected_nonce is only 0 from firmware
+        # that doesn't support windowed messages.
+        self._next_nonce = randint(1, 0xffffffff)
+        self._session_id = randint(1, 0xffffffff)
+        self._window_size = Splitflap.WINDOW_SIZE
         self._run = True
 
         self._lock = Lock()
@@ -62,9 +106,23 @@ class Splitflap(object):
         self._current_config = splitflap_pb2.SplitflapConfig()
         self._num_modules = None
 
+        # Latest full state, kept up to date by applying SplitflapStateDelta messages to the last keyframe
+        self._state = None
+        self._resync_requested = False
+
         self._alphabet = Splitflap._LEGACY_ALPHABET
         self._alphabet_received = False
 
+        # Time each in-flight nonce was first written. Entries are dropped when a message is resent, since an ack
+        # can't be matched to a particular transmission then (Karn's algorithm). Both dicts are shared by the read and
+        # write threads and ping() callers, so are guarded by _timing_lock (not _lock, which is held while handlers
+        # run, so handlers can still call ping()).
+        self._timing_lock = Lock()
+        self._send_times = {}
+        self._ping_waiters = {}
+        self._rtt_stats = LatencyStats()
+        self._processing_stats = LatencyStats()
+
     def _read_loop(self):
         self._logger.debug('Read loop started')
         buffer = b''
@@ -109,13 +167,31 @@ class Splitflap(object):
         self._logger.debug(message)
 
         payload_type = message.WhichOneof('payload')
+        payload = getattr(message, payload_type)
+
+        # Packed module states are expanded and deltas reassembled into full states, so handlers only ever see
+        # 'splitflap_state' with its ModuleState messages filled in
+        if payload_type in ('splitflap_state', 'splitflap_state_delta') and payload.packed_modules:
+            Splitflap._unpack_modules(payload)
+
+        if payload_type == 'splitflap_state_delta':
+            payload = self._apply_state_delta(payload)
+            if payload is None:
+                return
+            payload_type = 'splitflap_state'
+        elif payload_type == 'splitflap_state':
+            self._state = splitflap_pb2.SplitflapState()
+            self._state.CopyFrom(payload)
+            self._resync_requested = False
 
         # If this is an ack, notify the write thread
         if payload_type == 'ack':
-            nonce = message.ack.nonce
-            self._ack_q.put(nonce)
+            self._record_round_trip(payload.nonce)
+            self._ack_q.put(message.ack)
+        elif payload_type == 'command_applied':
+            self._processing_stats.add(((payload.applied_micros - payload.received_micros) & 0xffffffff) / 1e6)
         elif payload_type == 'splitflap_state':
-            num_modules_reported = len(message.splitflap_state.modules)
+            num_modules_reported = len(payload.modules)
             if self._num_modules is None:
                 self._num_modules = num_modules_reported
                 for i in range(num_modules_reported):
@@ -125,53 +201,178 @@ class Splitflap(object):
         elif payload_type == 'general_state' and not self._alphabet_received:
             self._alphabet_received = True
             self._alphabet = list(message.general_state.flap_character_set.decode('utf-8'))
-
+        elif payload_type == 'log_records':
+            # Also deliver structured logs as text, so 'log' handlers see every message
+            for record in payload.records:
+                self._dispatch('log', splitflap_pb2.Log(msg=Splitflap.format_log_record(record)))
+
+        self._dispatch(payload_type, payload)
+
+    def _record_round_trip(self, nonce):
+        with self._timing_lock:
+            sent_time = self._send_times.pop(nonce, None)
+            waiter = self._ping_waiters.pop(nonce, None)
+        rtt = time.monotonic() - sent_time if sent_time is not None else None
+        if rtt is not None:
+            self._rtt_stats.add(rtt)
+        if waiter is not None:
+            waiter.put(rtt)
+
+    def _dispatch(self, payload_type, payload):
         with self._lock:
             for handler in self._message_handlers[payload_type] + self._message_handlers[None]:
                 try:
-                    handler(getattr(message, payload_type))
+                    handler(payload)
                 except:
                     self._logger.warning(f'Unhandled exception in message handler ({payload_type})', exc_info=True)
+
+    @staticmethod
+    def format_log_record(record):
+        """Formats a LogRecords.Record as text, the way the firmware's formatLogRecord() would."""
+        log_format = LOG_FORMATS.get(record.format_id)
+        if log_format is None:
+            return f'Unknown log format {record.format_id} {list(record.args)}'
+
+        args = iter(record.args)
+        def convert(match):
+            spec = match.group(0)
+            if spec == '%%':
+                return '%'
+            arg = next(args, None)
+            if arg is None:
+                return '?'
+            conversion = spec[-1]
+            if conversion in 'di':
+                arg = arg - (1 << 32) if arg & 0x80000000 else arg
+            elif conversion == 'f':
+                arg = struct.unpack('<f', struct.pack('<I', arg))[0]
+            elif conversion == 'u':
+                spec = spec[:-1] + 'd'
+            return spec % arg
+        return _LOG_CONVERSION.sub(convert, log_format)
+
+    # Packed module state layout, see SplitflapState.packed_modules in splitflap.proto
+    _PACKED_STATE_MASK = 0x07
+    _PACKED_MOVING = 1 << 3
+    _PACKED_HOME_STATE = 1 << 4
+    _PACKED_HAS_COUNTS = 1 << 5
+
+    @staticmethod
+    def _unpack_module_state(data, offset, module_state):
+        """Fills in module_state from the packed module at data[offset:] and returns the offset of the next one."""
+        flags = data[offset]
+        module_state.state = flags & Splitflap._PACKED_STATE_MASK
+        module_state.moving = bool(flags & Splitflap._PACKED_MOVING)
+        module_state.home_state = bool(flags & Splitflap._PACKED_HOME_STATE)
+        module_state.flap_index = data[offset + 1]
+        if not flags & Splitflap._PACKED_HAS_COUNTS:
+            return offset + 2
+        module_state.count_unexpected_home = data[offset + 2]
+        module_state.count_missed_home = data[offset + 3]
+        return offset + 4
+
+    @staticmethod
+    def _unpack_modules(payload):
+        """Expands the packed_modules of a SplitflapState or SplitflapStateDelta into its modules field, in place."""
+        data = payload.packed_modules
+        offset = 0
+        while offset < len(data):
+            if isinstance(payload, splitflap_pb2.SplitflapStateDelta):
+                module_delta = payload.modules.add()
+                module_delta.index = data[offset]
+                offset = Splitflap._unpack_module_state(data, offset + 1, module_delta.state)
+            else:
+                offset = Splitflap._unpack_module_state(data, offset, payload.modules.add())
+        payload.ClearField('packed_modules')
+
+    def _apply_state_delta(self, delta):
+        """Applies a delta to the last known state and returns the updated state, or None if the delta can't be applied."""
+        if self._state is None or delta.sequence != (self._state.sequence + 1) & 0xffffffff:
+            # Missed a message (or haven't seen a keyframe yet); ask for a full state to resync
+            if not self._resync_requested:
+                self._logger.debug(f'State sequence gap (expected {None if self._state is None else self._state.sequence + 1}, got {delta.sequence}), requesting full state')
+                self._resync_requested = True
+                self.request_state()
+            return None
+
+        for module_delta in delta.modules:
+            if module_delta.index >= len(self._state.modules):
+                self._logger.warning(f'State delta for unknown module {module_delta.index}')
+                continue
+            self._state.modules[module_delta.index].CopyFrom(module_delta.state)
+        self._state.loopbacks_ok = delta.loopbacks_ok
+        self._state.sequence = delta.sequence
+
+        state = splitflap_pb2.SplitflapState()
+        state.CopyFrom(self._state)
+        return state
     
     def _write_loop(self):
+        """Go-back-N sender: keeps up to _window_size messages in flight and resends from the oldest unacked on timeout."""
         self._logger.debug('Write loop started')
+        in_flight = []  # [nonce, message, retry_time], oldest first
         while True:
-            data = self._out_q.get()
-            # Check for shutdown
-            if not self._run:
-                self._logger.debug('Write loop exiting @ _out_q')
-                return
-            (nonce, encoded_message) = data
-
-            next_retry = 0
-            while True:
-                if time.time() >= next_retry:
-                    if next_retry > 0:
-                        self._logger.debug('Retry write...')
-                    self._serial.write(encoded_message)
-                    self._serial.write(b'\0')
-                    next_retry = time.time() + Splitflap.RETRY_TIMEOUT
-                
+            # Send queued messages while there's room in the window
+            while len(in_flight) < self._window_size:
                 try:
-                    latest_ack_nonce = self._ack_q.get(timeout=next_retry - time.time())
+                    data = self._out_q.get_nowait()
                 except Empty:
-                    latest_ack_nonce = None
-
+                    break
                 # Check for shutdown
-                if not self._run:
-                    self._logger.debug('Write loop exiting @ _ack_q')
+                if data is None or not self._run:
+                    self._logger.debug('Write loop exiting @ _out_q')
                     return
+                (nonce, message) = data
+                in_flight.append([nonce, message, 0])
+                with self._timing_lock:
+                    self._send_times[nonce] = time.monotonic()
+                self._write_message(message, in_flight[0][0])
+                in_flight[-1][2] = time.time() + Splitflap.RETRY_TIMEOUT
+
+            # Wait for an ack, a newly queued message (signaled with None), or the oldest message to time out
+            timeout = max(0, in_flight[0][2] - time.time()) if in_flight else None
+            try:
+                ack = self._ack_q.get(timeout=timeout)
+            except Empty:
+                ack = None
 
-                if latest_ack_nonce == nonce:
-                    break
-                else:
-                    self._logger.debug(f'Got unexpected nonce: {latest_ack_nonce}')
-    
-    def _enqueue_message(self, message):
-        nonce = self._next_nonce
-        self._next_nonce += 1
+            # Check for shutdown
+            if not self._run:
+                self._logger.debug('Write loop exiting @ _ack_q')
+                return
 
-        message.nonce = nonce
+            if ack is not None:
+                if ack.next_expected_nonce == 0:
+                    # Firmware without windowed message support acks each nonce individually and may apply messages
+                    # out of order, so only send one at a time
+                    self._window_size = 1
+                    in_flight = [m for m in in_flight if m[0] != ack.nonce]
+                else:
+                    # Cumulative ack: everything before next_expected_nonce has been applied
+                    in_flight = [m for m in in_flight if not Splitflap._nonce_before(m[0], ack.next_expected_nonce)]
+                # Forget send times of messages whose own ack was lost
+                in_flight_nonces = set(m[0] for m in in_flight)
+                with self._timing_lock:
+                    for nonce in [n for n in self._send_times if n not in in_flight_nonces]:
+                        self._send_times.pop(nonce, None)
+            elif in_flight and time.time() >= in_flight[0][2]:
+                self._logger.debug(f'Retry write of {len(in_flight)} messages...')
+                with self._timing_lock:
+                    for m in in_flight:
+                        self._send_times.pop(m[0], None)
+                for m in in_flight:
+                    self._write_message(m[1], in_flight[0][0])
+                    m[2] = time.time() + Splitflap.RETRY_TIMEOUT
+
+    @staticmethod
+    def _nonce_before(nonce, other):
+        """Whether nonce comes before other, allowing for 32-bit wraparound."""
+        return 0 < ((other - nonce) & 0xffffffff) < 0x80000000
+
+    def _write_message(self, message, window_base):
+        message.windowed = True
+        message.window_base = window_base
+        message.session_id = self._session_id
 
         payload = bytearray(message.SerializeToString())
 
@@ -181,14 +382,24 @@ class Splitflap(object):
         payload.append((crc >> 16) & 0xff)
         payload.append((crc >> 24) & 0xff)
 
-        encoded_message = cobs.encode(payload)
+        self._serial.write(cobs.encode(payload))
+        self._serial.write(b'\0')
 
-        self._out_q.put((nonce, encoded_message))
+    def _enqueue_message(self, message):
+        nonce = self._next_nonce
+        self._next_nonce = (self._next_nonce + 1) & 0xffffffff or 1
+
+        message.nonce = nonce
+
+        self._out_q.put((nonce, message))
+        # Wake the write loop in case it's waiting on acks
+        self._ack_q.put(None)
 
         approx_q_length = self._out_q.qsize()
         self._logger.debug(f'Out q length: {approx_q_length}')
         if approx_q_length > 10:
             self._logger.warning(f'Output queue length is high! ({approx_q_length}) Is the splitflap still connected and functional?')
+        return nonce
 
     def get_alphabet(self):
         return self._alphabet
@@ -227,6 +438,25 @@ class Splitflap(object):
         message.splitflap_config.CopyFrom(self._current_config)
         self._enqueue_message(message)
 
+    def send_batch(self, entries):
+        """Sends several commands/configs as a single message, applied in order by the splitflap.
+
+        entries is a list of (delay_millis, message) tuples, where message is a SplitflapCommand or SplitflapConfig and
+        delay_millis is how long to wait after the previous entry (or after the batch arrives, for the first one).
+        Commands, configs and batches sent afterwards are held back (and resent) until the whole batch has been applied.
+        """
+        message = splitflap_pb2.ToSplitflap()
+        for (delay_millis, payload) in entries:
+            entry = message.batch.entries.add()
+            entry.delay_millis = delay_millis
+            if isinstance(payload, splitflap_pb2.SplitflapCommand):
+                entry.splitflap_command.CopyFrom(payload)
+            elif isinstance(payload, splitflap_pb2.SplitflapConfig):
+                entry.splitflap_config.CopyFrom(payload)
+            else:
+                raise TypeError(f'Unsupported batch entry type {type(payload)}')
+        self._enqueue_message(message)
+
     def start(self):
         self.read_thread = Thread(target=self._read_loop)
         self.write_thread = Thread(target=self._write_loop)
@@ -254,9 +484,116 @@ class Splitflap(object):
 
     def request_state(self):
         message = splitflap_pb2.ToSplitflap()
-        message.request_state.SetInParent()
+        message.request_state.enable_state_deltas = True
+        message.request_state.packed_module_state = True
+        message.request_state.structured_logs = True
         self._enqueue_message(message)
 
+    def subscribe(self, splitflap_state=True, general_state=True, supervisor_state=True, logs=True,
+                  min_state_interval=None, max_state_interval=None, general_state_interval=None, modules=None,
+                  command_timing=True):
+        """Chooses which messages the splitflap sends on its own, and how often.
+
+        Intervals are in seconds; None keeps the splitflap's default. If modules is given (an iterable of module
+        indexes), only changes to those modules trigger state updates, though full states still report every module.
+        command_timing enables the CommandApplied reports behind the processing latency in get_latency_stats().
+        Each call replaces the previous subscription.
+        """
+        message = splitflap_pb2.ToSplitflap()
+        subscription = message.subscribe
+        subscription.splitflap_state = splitflap_state
+        subscription.general_state = general_state
+        subscription.supervisor_state = supervisor_state
+        subscription.logs = logs
+        subscription.command_timing = command_timing
+        if min_state_interval is not None:
+            subscription.min_state_interval_millis = max(1, int(min_state_interval * 1000))
+        if max_state_interval is not None:
+            subscription.max_state_interval_millis = max(1, int(max_state_interval * 1000))
+        if general_state_interval is not None:
+            subscription.general_state_interval_millis = max(1, int(general_state_interval * 1000))
+        if modules is not None:
+            module_mask = bytearray(32)
+            for module in modules:
+                module_mask[module // 8] |= 1 << (module % 8)
+            subscription.modules = bytes(module_mask).rstrip(b'\0') or b'\0'
+        self._enqueue_message(message)
+
+    def ping(self, timeout=1.0):
+        """Returns the round trip time to the splitflap in seconds, or None if the ping had to be resent or wasn't
+        acked within timeout."""
+        waiter = Queue()
+        message = splitflap_pb2.ToSplitflap()
+        message.ping.SetInParent()
+        # The nonce is only known once queued, so hold the lock until the waiter is registered in case the ack is quick
+        with self._timing_lock:
+            nonce = self._enqueue_message(message)
+            self._ping_waiters[nonce] = waiter
+        try:
+            return waiter.get(timeout=timeout)
+        except Empty:
+            return None
+        finally:
+            with self._timing_lock:
+                self._ping_waiters.pop(nonce, None)
+
+    def get_latency_stats(self):
+        """Returns percentiles (see LatencyStats.percentiles) of recent latencies, in seconds:
+
+        'rtt': time from writing a message to receiving its ack, for messages that weren't resent
+        'processing': on-device time from receiving a command/config to the motion loop applying it (only reported
+            by the splitflap while subscribed with command_timing)
+        """
+        return {
+            'rtt': self._rtt_stats.percentiles(),
+            'processing': self._processing_stats.percentiles(),
+        }
+
+    def set_baud_rate(self, baud_rate):
+        """Negotiates a new serial baud rate with the splitflap.
+
+        Returns True if both sides switched. If the splitflap rejects the rate or the link doesn't work at the new
+        rate, both sides stay at (or fall back to) the previous rate and False is returned.
+        """
+        previous_baud_rate = self._serial.baudrate
+        if baud_rate == previous_baud_rate:
+            return True
+
+        responses = Queue()
+        unregister = self.add_handler('baud_rate_change', responses.put)
+        try:
+            message = splitflap_pb2.ToSplitflap()
+            message.set_baud_rate.baud_rate = baud_rate
+            self._enqueue_message(message)
+            response = responses.get(timeout=BAUD_RATE_CONFIRM_TIMEOUT + Splitflap.RETRY_TIMEOUT * 4)
+        except Empty:
+            self._logger.warning(f'No response to baud rate change to {baud_rate}')
+            return False
+        finally:
+            unregister()
+
+        if not response.accepted or response.baud_rate != baud_rate:
+            self._logger.warning(f'Splitflap rejected baud rate {baud_rate}')
+            return False
+
+        # The splitflap has switched; follow, then confirm by getting a response at the new rate
+        self._serial.baudrate = baud_rate
+        states = Queue()
+        unregister = self.add_handler('splitflap_state', states.put)
+        try:
+            self.request_state()
+            states.get(timeout=BAUD_RATE_CONFIRM_TIMEOUT)
+        except Empty:
+            # The splitflap will fall back on its own, and the pending request will be retried at the old rate
+            self._logger.warning(f'No response at baud rate {baud_rate}, falling back to {previous_baud_rate}')
+            self._serial.baudrate = previous_baud_rate
+            return False
+        finally:
+            unregister()
+
+        self._logger.info(f'Switched to baud rate {baud_rate}')
+        return True
+
     def hard_reset(self):
         self._serial.setRTS(True)
         self._serial.setDTR(False)
@@ -270,7 +607,7 @@ class Splitflap(object):
 
 
 @contextmanager
-def splitflap_context(serial_port, default_logging=True, wait_for_comms=True):
+def splitflap_context(serial_port, default_logging=True, wait_for_comms=True, baud_rate=None):
     with serial.Serial(serial_port, SPLITFLAP_BAUD, timeout=1.0) as ser:
         s = Splitflap(ser)
         s.start()
@@ -293,9 +630,15 @@ def splitflap_context(serial_port, default_logging=True, wait_for_comms=True):
             unregister()
             logging.info('Connected!')
 
+        if baud_rate is not None:
+            s.set_baud_rate(baud_rate)
+
         try:
             yield s
         finally:
+            # Leave the splitflap at the default rate so the next connection can reach it
+            if ser.baudrate != SPLITFLAP_BAUD:
+                s.set_baud_rate(SPLITFLAP_BAUD)
             s.shutdown()
 
 
@@ -317,9 +660,9 @@ def ask_for_serial_port():
     return ports[port_index].device
 
 
-def _run_example():
+def _run_example(baud_rate):
     p = ask_for_serial_port()
-    with splitflap_context(p) as s:
+    with splitflap_context(p, baud_rate=baud_rate) as s:
         modules = s.get_num_modules()
         alphabet = s.get_alphabet()
 
@@ -357,9 +700,10 @@ def _run_example():
 if __name__ == '__main__':
     parser = argparse.ArgumentParser('Splitflap python interface example')
     parser.add_argument('--verbose', '-v', action='store_true', help='Enable verbose logging')
+    parser.add_argument('--baud', type=int, help='Negotiate a higher serial baud rate after connecting (e.g. 921600)')
     args = parser.parse_args()
 
     log_level = logging.DEBUG if args.verbose else logging.INFO
     logging.basicConfig(level=log_level, format='%(asctime)s:%(name)s:%(levelname)s:%(message)s')
 
-    _run_example()
+    _run_example(args.baud)